@@ -0,0 +1,35 @@
+"""WSGI applications for bench/run.sh"""
+import os
+
+
+def hello(environ, start_response):
+    start_response('200 OK', [('Content-Type', 'text/plain'),
+                              ('Content-Length', '5')])
+    return [b'hello']
+
+
+def cpu(environ, start_response):
+    """About a millisecond of pure-Python work per request"""
+    n = sum(i * i for i in range(20000)) % 10
+    start_response('200 OK', [('Content-Type', 'text/plain'),
+                              ('Content-Length', '1')])
+    return [str(n).encode()]
+
+
+def _download(environ, start_response, blocksize):
+    f = open(os.environ['BENCH_FILE'], 'rb')
+    size = os.fstat(f.fileno()).st_size
+    start_response('200 OK', [('Content-Type', 'application/octet-stream'),
+                              ('Content-Length', str(size))])
+    return environ['wsgi.file_wrapper'](f, blocksize)
+
+
+def download(environ, start_response):
+    """$BENCH_FILE through wsgi.file_wrapper, i.e. sendfile()"""
+    return _download(environ, start_response, None)
+
+
+def download_16k(environ, start_response):
+    """Same, with a 16 KiB blocksize hint, which caps each sendfile() call
+    at the size bjoern used to send"""
+    return _download(environ, start_response, 16384)
@@ -0,0 +1,262 @@
+/* HTTP load generator for bench/run.sh: one blocking client thread per
+ * connection, each sending GET requests back to back for a fixed time.
+ * Responses must carry a Content-Length (those of bench/apps.py do).
+ * Prints requests per second, throughput and latency percentiles. */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* Latencies kept per connection for the percentiles */
+#define MAX_SAMPLES 1000000
+#define RECV_SIZE (64*1024)
+
+static struct sockaddr_in server_addr;
+static char request[16*1024];
+static size_t request_len;
+static bool keep_alive;
+static volatile bool stop;
+
+typedef struct {
+    pthread_t thread;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long long bytes;
+    float* latencies; /* seconds */
+} client;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+connect_server(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == -1)
+        return -1;
+    if(connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static bool
+send_all(int fd, const char* data, size_t len)
+{
+    while(len) {
+        ssize_t n = write(fd, data, len);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Read one response into `buf` (RECV_SIZE + 1 bytes) and discard it.
+ * Returns its size, or -1 on errors and early EOF. */
+static long long
+read_response(int fd, char* buf)
+{
+    size_t len = 0;
+    char* end;
+    buf[len] = '\0';
+    while((end = strstr(buf, "\r\n\r\n")) == NULL) {
+        if(len == RECV_SIZE)
+            return -1;
+        ssize_t n = read(fd, buf + len, RECV_SIZE - len);
+        if(n <= 0)
+            return -1;
+        len += n;
+        buf[len] = '\0';
+    }
+
+    size_t head_len = end + 4 - buf;
+    long long content_length = -1;
+    for(char* line = strstr(buf, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+        if(!strncasecmp(line + 2, "Content-Length:", 15))
+            content_length = atoll(line + 17);
+    }
+    if(content_length < 0)
+        return -1;
+
+    /* Requests aren't pipelined, so nothing follows the body */
+    long long total = head_len + content_length;
+    long long have = len;
+    while(have < total) {
+        ssize_t n = read(fd, buf, RECV_SIZE);
+        if(n <= 0)
+            return -1;
+        have += n;
+    }
+    return have == total ? total : -1;
+}
+
+static void*
+run_client(void* arg)
+{
+    client* c = arg;
+    char* buf = malloc(RECV_SIZE + 1);
+    int fd = -1;
+
+    while(!stop) {
+        double started = now();
+        if(fd == -1 && (fd = connect_server()) == -1) {
+            c->errors++;
+            usleep(1000);
+            continue;
+        }
+        long long size = -1;
+        if(send_all(fd, request, request_len))
+            size = read_response(fd, buf);
+        if(size < 0) {
+            c->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if(!keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+        if(c->requests < MAX_SAMPLES)
+            c->latencies[c->requests] = now() - started;
+        c->requests++;
+        c->bytes += size;
+    }
+    if(fd != -1)
+        close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int
+compare_floats(const void* a, const void* b)
+{
+    float x = *(const float*)a, y = *(const float*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] PATH\n"
+            "  -c N      concurrent connections, one thread each (default 8)\n"
+            "  -d SECS   duration (default 5)\n"
+            "  -k        keep connections alive (default: one per request)\n"
+            "  -H FILE   add the header lines in FILE to every request\n"
+            "  -a ADDR   server address (default 127.0.0.1)\n"
+            "  -p PORT   server port (default 8000)\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+    int connections = 8;
+    int duration = 5;
+    const char* headers_file = NULL;
+    const char* address = "127.0.0.1";
+    int port = 8000;
+    int opt;
+
+    while((opt = getopt(argc, argv, "c:d:kH:a:p:")) != -1) {
+        switch(opt) {
+        case 'c': connections = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'k': keep_alive = true; break;
+        case 'H': headers_file = optarg; break;
+        case 'a': address = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if(optind != argc - 1 || connections < 1 || duration < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, address, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Bad address: %s\n", address);
+        return 2;
+    }
+
+    request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n%s",
+                           argv[optind], address, keep_alive ? "" : "Connection: close\r\n");
+    if(headers_file) {
+        FILE* f = fopen(headers_file, "r");
+        if(f == NULL) {
+            perror(headers_file);
+            return 2;
+        }
+        char line[8192];
+        while(fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if(line[0] == '\0' || line[0] == '#')
+                continue;
+            request_len += snprintf(request + request_len, sizeof(request) - request_len,
+                                    "%s\r\n", line);
+            if(request_len >= sizeof(request) - 2) {
+                fprintf(stderr, "%s: too many headers\n", headers_file);
+                return 2;
+            }
+        }
+        fclose(f);
+    }
+    request_len += snprintf(request + request_len, sizeof(request) - request_len, "\r\n");
+
+    client* clients = calloc(connections, sizeof(client));
+    for(int i = 0; i < connections; ++i) {
+        clients[i].latencies = malloc(MAX_SAMPLES * sizeof(float));
+        pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+    }
+    double started = now();
+    sleep(duration);
+    stop = true;
+
+    unsigned long requests = 0, errors = 0, samples = 0;
+    unsigned long long bytes = 0;
+    for(int i = 0; i < connections; ++i) {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+    }
+    double elapsed = now() - started;
+
+    float* latencies = malloc(sizeof(float) * (requests + 1));
+    for(int i = 0; i < connections; ++i) {
+        unsigned long n = clients[i].requests < MAX_SAMPLES ? clients[i].requests : MAX_SAMPLES;
+        memcpy(latencies + samples, clients[i].latencies, n * sizeof(float));
+        samples += n;
+    }
+    qsort(latencies, samples, sizeof(float), compare_floats);
+
+    printf("%.0f req/s  %.1f MB/s  p50=%.3fms p99=%.3fms  errors=%lu\n",
+           requests / elapsed, bytes / elapsed / 1e6,
+           samples ? latencies[samples / 2] * 1e3 : 0,
+           samples ? latencies[(size_t)(samples * 0.99)] * 1e3 : 0,
+           errors);
+    return 0;
+}
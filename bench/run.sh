@@ -0,0 +1,115 @@
+#!/bin/bash
+# Reproducible loopback benchmarks: ./run.sh [SCENARIO...] (default: all
+# but io_uring)
+#
+# Every scenario starts bjoern on 127.0.0.1:$PORT with bench/apps.py,
+# drives it with loadgen and prints one result line per configuration.
+# To compare two versions, run the same scenario with BJOERN pointing to
+# a build of each. Client and server share the machine, so use a box with
+# a few spare cores and compare numbers from the same box only.
+#
+#   BJOERN    bjoern binary (default: ../build/bjoern)
+#   PORT      (default 8000)
+#   DURATION  seconds per configuration (default 5)
+#   CONNS     concurrent client connections (default 8)
+set -e
+cd "$(dirname "$0")"
+
+BJOERN=${BJOERN:-../build/bjoern}
+PORT=${PORT:-8000}
+DURATION=${DURATION:-5}
+CONNS=${CONNS:-8}
+SERVER_PID=
+
+make -s loadgen
+
+start_server() {
+    "$BJOERN" -p "$PORT" "$@" > server.log 2>&1 &
+    SERVER_PID=$!
+    for i in $(seq 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/"$PORT") 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "bjoern did not start:"; cat server.log; exit 1
+}
+
+stop_server() {
+    kill -INT "$SERVER_PID" 2>/dev/null || true
+    wait "$SERVER_PID" 2>/dev/null || true
+}
+trap stop_server EXIT
+
+# load LABEL SERVER_ARGS -- LOADGEN_ARGS
+# With STATS=PATTERN set, also prints the matching lines of the server's
+# SIGUSR1 statistics.
+load() {
+    local label=$1; shift
+    local server_args=()
+    while [ "$1" != "--" ]; do server_args+=("$1"); shift; done
+    shift
+    start_server "${server_args[@]}"
+    printf "%-32s " "$label"
+    ./loadgen -p "$PORT" -d "$DURATION" -c "$CONNS" "$@"
+    if [ -n "$STATS" ]; then
+        kill -USR1 "$SERVER_PID"
+        sleep 0.2
+        grep "$STATS" server.log | sed 's/^/    /'
+    fi
+    stop_server
+}
+
+# A new connection per request: accept batching and accept4()
+scenario_accept() {
+    load "accept, batch 1" -b 1 apps:hello -- /
+    load "accept, batch 64 (default)" apps:hello -- /
+}
+
+# Keep-alive requests with a browser's worth of well-known headers, which
+# map to pre-built environ keys
+scenario_headers() {
+    load "no extra headers" apps:hello -- -k /
+    load "browser headers" apps:hello -- -k -H headers/browser.txt /
+}
+
+# Keep-alive requests with 30 long, unknown header names, which go
+# through the vectorized CGI name transform
+scenario_long_headers() {
+    load "no extra headers" apps:hello -- -k /
+    load "long header names" apps:hello -- -k -H headers/long-names.txt /
+}
+
+# A CPU-bound app on one event loop vs one per core, and vs an app thread
+# pool. Calls only run in parallel when BJOERN embeds a free-threaded
+# CPython (3.13t and later); with the GIL, expect no gain.
+scenario_threads() {
+    local n=$(nproc)
+    load "cpu, 1 loop" apps:cpu -- -k /
+    load "cpu, $n loops" -t "$n" apps:cpu -- -k /
+    load "cpu, 1 loop, $n app threads" -a "$n" apps:cpu -- -k /
+}
+
+# libev readiness callbacks vs the io_uring engine, with keep-alive and
+# with a connection per request. Needs BJOERN built with WANT_IO_URING=yes.
+scenario_io_uring() {
+    load "libev, keep-alive" apps:hello -- -k /
+    load "io_uring, keep-alive" --io-uring apps:hello -- -k /
+    load "libev, connection per request" apps:hello -- /
+    load "io_uring, connection per request" --io-uring apps:hello -- /
+}
+
+# Keep-alive downloads through wsgi.file_wrapper, with sendfile() calls as
+# large as the socket takes vs capped at 16 KiB by a blocksize hint. The
+# file, large.bin, is generated on first use with FILE_SIZE MiB (default
+# 256).
+scenario_sendfile() {
+    export BENCH_FILE=large.bin
+    [ -f large.bin ] || head -c "${FILE_SIZE:-256}M" /dev/urandom > large.bin
+    STATS=sendfile load "sendfile, whole file" apps:download -- -k /
+    STATS=sendfile load "sendfile, blocksize 16 KiB" apps:download_16k -- -k /
+}
+
+SCENARIOS=${*:-accept headers long_headers threads sendfile}
+for s in $SCENARIOS; do
+    echo "== $s"
+    scenario_$s
+done
@@ -5,68 +5,132 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h> 
 #include "server.h"
 #include "wsgi.h"
 #include "filewrapper.h"
+#include "input.h"
 
+/* Tunables collected from the command line, copied into every ServerInfo */
+static ServerInfo server_options = {
+    .accept_batch = DEFAULT_ACCEPT_BATCH,
+    .input_spill_threshold = DEFAULT_INPUT_SPILL_THRESHOLD,
+    .write_budget = DEFAULT_WRITE_BUDGET,
+    .threads = 1,
+    .read_timeout = DEFAULT_READ_TIMEOUT,
+    .header_timeout = DEFAULT_HEADER_TIMEOUT,
+    .body_timeout = DEFAULT_BODY_TIMEOUT,
+    .write_timeout = DEFAULT_WRITE_TIMEOUT,
+    .keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT,
+};
+
+int bindCSocket(char* sock, char* host, int port);
+int makeCSocket(char* sock, char* host, int port);
+
+/* Serve `wsgi_app` on `fd`. Every additional event loop thread gets its own
+ * SO_REUSEPORT listener on the same address, so the kernel spreads the
+ * connections across them. */
 void run(PyObject* wsgi_app, int fd, char* host, int port)
 {
-    ServerInfo info;
+    int threads = server_options.threads;
+    ServerInfo* infos = calloc(threads, sizeof(ServerInfo));
+    int i;
 
-    info.wsgi_app = wsgi_app;
-    info.sockfd = fd;
+    infos[0] = server_options;
+    infos[0].wsgi_app = wsgi_app;
+    infos[0].sockfd = fd;
 
     if(strlen(host)) {
-        info.host = Py_BuildValue("s", host);
-        info.port = Py_BuildValue("i", port);
+        infos[0].host = Py_BuildValue("s", host);
+        infos[0].port = Py_BuildValue("i", port);
     }
     else  
-        info.host = NULL;
+        infos[0].host = NULL;
+
+    for(i = 1; i < threads; i++) {
+        infos[i] = infos[0];
+        infos[i].sockfd = makeCSocket("", host, port);
+        if(infos[i].sockfd < 0)
+            goto finally;
+    }
 
-    _initialize_request_module(&info);
-    server_run(&info);
+    for(i = 0; i < threads; i++)
+        _initialize_request_module(&infos[i]);
+    server_run(infos, threads);
+
+finally:
+    for(int j = 0; j < threads; j++)
+        Py_XDECREF(infos[j].wsgi_base_dict);
+    while(--i > 0) {
+        /* -1 if its event loop thread couldn't be started */
+        if(infos[i].sockfd >= 0)
+            close(infos[i].sockfd);
+    }
+    free(infos);
 }
 
 void init_bjoern(void)
 {
     _init_common();
     _init_filewrapper();
+    _init_input();
 
     PyType_Ready(&FileWrapper_Type);
     assert(FileWrapper_Type.tp_flags & Py_TPFLAGS_READY);
     PyType_Ready(&StartResponse_Type);
     assert(StartResponse_Type.tp_flags & Py_TPFLAGS_READY);
+    PyType_Ready(&Input_Type);
+    assert(Input_Type.tp_flags & Py_TPFLAGS_READY);
     Py_INCREF(&FileWrapper_Type);
     Py_INCREF(&StartResponse_Type);
+    Py_INCREF(&Input_Type);
 }
 
-int makeCSocket(char* sock, char* host, int port) {
+/* Bound but not yet listening: a socket in that state isn't part of the
+ * SO_REUSEPORT group, the kernel routes no connections to it */
+int bindCSocket(char* sock, char* host, int port) {
     //for sock, host use "" default, not NULL,
     int fd;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
     int ok = 1;
 
     if(!strlen(sock)) {
-        //use host:port mode
-        fd = socket(AF_INET, SOCK_STREAM, 0);
-        if(fd < 0) {
-            printf("Error in init socket\n");
-            return -1;
+        //use host:port mode, hosts containing ':' are IPv6 literals
+        memset(&addr, 0, sizeof(addr));
+        if(strchr(host, ':')) {
+            struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&addr;
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(port);
+            if(inet_pton(AF_INET6, host, &sin6->sin6_addr) != 1) {
+                printf("Error in host address: %s\n", host);
+                return -1;
+            }
+            addrlen = sizeof(struct sockaddr_in6);
+        }
+        else {
+            struct sockaddr_in* sin = (struct sockaddr_in*)&addr;
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(port);
+            sin->sin_addr.s_addr = inet_addr(host);
+            addrlen = sizeof(struct sockaddr_in);
         }
 
-        memset(&addr, 0, sizeof(struct sockaddr_in));
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(port);
-        addr.sin_addr.s_addr  = inet_addr(host);
-
-        if(bind(fd, (struct sockaddr* )&addr, sizeof(addr)) < 0) {
-            printf("Error in bind socket\n");
+        fd = socket(addr.ss_family, SOCK_STREAM, 0);
+        if(fd < 0) {
+            printf("Error in init socket\n");
             return -1;
         }
 
+        //SO_REUSEPORT must be set before bind, otherwise prefork workers
+        //can't bind their own listener to the same address.
         if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &ok, sizeof(int)) < 0) {
             printf("Error in set sockopt\n");
             return -1;
@@ -76,6 +140,11 @@ int makeCSocket(char* sock, char* host, int port) {
             printf("Error in set sockopt\n");
             return -1;
         }
+
+        if(bind(fd, (struct sockaddr* )&addr, addrlen) < 0) {
+            printf("Error in bind socket\n");
+            return -1;
+        }
     }
     else {
         //use unix sock mode, sock must like unix:t1.sock
@@ -83,6 +152,14 @@ int makeCSocket(char* sock, char* host, int port) {
         return -1;
     }
 
+    return fd;
+}
+
+int makeCSocket(char* sock, char* host, int port) {
+    int fd = bindCSocket(sock, host, port);
+    if(fd < 0)
+        return -1;
+
     if(listen(fd, 1024) < 0) {
         printf("Error in listen socket\n");
         return -1;
@@ -160,20 +237,344 @@ error:
     return NULL;
 }
 
+/* Prefork mode: the master imports the app once, then forks `workers`
+ * children. Every worker binds its own SO_REUSEPORT listener and runs its
+ * own event loop, so the kernel spreads accepts across them. The master
+ * only supervises: it respawns workers that die and forwards SIGINT/SIGTERM. */
+
+/* Workers that exit within WORKER_MIN_LIFETIME seconds of starting are
+ * respawned a second later; after WORKER_MAX_FAILURES of those in a row the
+ * master gives up, such a worker isn't going to start (e.g. bind fails). */
+#define WORKER_MIN_LIFETIME 1
+#define WORKER_MAX_FAILURES 5
+
+static double monotonic_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t spawn_worker(PyObject* pApp, char* host, int port, sigset_t* mask)
+{
+    pid_t pid;
+    int fd;
+
+    PyOS_BeforeFork();
+    pid = fork();
+    if(pid != 0) {
+        PyOS_AfterFork_Parent();
+        return pid;
+    }
+
+    PyOS_AfterFork_Child();
+    sigprocmask(SIG_SETMASK, mask, NULL);
+
+    fd = makeCSocket("", host, port);
+    if(fd < 0)
+        exit(1);
+
+    run(pApp, fd, host, port);
+    if(PyErr_Occurred())
+        PyErr_Print();
+
+    close(fd);
+    exit(Py_FinalizeEx() < 0 ? 1 : 0);
+}
+
+static int supervise_workers(PyObject* pApp, int workers, char* host, int port)
+{
+    pid_t* pids = calloc(workers, sizeof(pid_t));
+    double* started = calloc(workers, sizeof(double));
+    double* respawn = calloc(workers, sizeof(double)); /* when to (re)start */
+    int* failures = calloc(workers, sizeof(int));
+    sigset_t signals, old_mask;
+    int signum = 0;
+    int ret = 0;
+    int i;
+
+    if(pids == NULL || started == NULL || respawn == NULL || failures == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        ret = -1;
+        goto out;
+    }
+
+    /* The signals stay blocked and are only taken by sigtimedwait() below,
+     * so one that arrives while we're busy respawning isn't missed */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, &old_mask);
+
+    while(true) {
+        double now = monotonic_time();
+        double next = 0; /* earliest pending respawn */
+        for(i = 0; i < workers; i++) {
+            if(pids[i] == 0 && respawn[i] <= now) {
+                pids[i] = spawn_worker(pApp, host, port, &old_mask);
+                started[i] = now;
+                if(pids[i] < 0) {
+                    fprintf(stderr, "Could not fork worker %d: %s, retrying\n", i, strerror(errno));
+                    pids[i] = 0;
+                    respawn[i] = now + WORKER_MIN_LIFETIME;
+                }
+            }
+            if(pids[i] == 0 && (next == 0 || respawn[i] < next))
+                next = respawn[i];
+        }
+
+        double wait = next ? next - now : 3600;
+        struct timespec timeout = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+        int sig = sigtimedwait(&signals, NULL, &timeout);
+        if(sig == SIGINT || sig == SIGTERM) {
+            signum = sig;
+            break;
+        }
+
+        /* SIGCHLD, or the timeout */
+        int status;
+        pid_t pid;
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for(i = 0; i < workers; i++) {
+                if(pids[i] != pid)
+                    continue;
+                pids[i] = 0;
+                now = monotonic_time();
+                if(now - started[i] < WORKER_MIN_LIFETIME) {
+                    failures[i]++;
+                    respawn[i] = now + WORKER_MIN_LIFETIME;
+                } else {
+                    failures[i] = 0;
+                    respawn[i] = now;
+                }
+                status = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+                if(failures[i] >= WORKER_MAX_FAILURES) {
+                    fprintf(stderr, "Worker %d (pid %d) exited with status %d right after "
+                            "starting %d times in a row, giving up\n", i, pid, status, failures[i]);
+                    ret = -1;
+                } else {
+                    fprintf(stderr, "Worker %d (pid %d) exited with status %d, respawning\n",
+                            i, pid, status);
+                }
+            }
+        }
+        if(ret)
+            break;
+    }
+
+    for(i = 0; i < workers; i++) {
+        if(pids[i] > 0)
+            kill(pids[i], signum ? signum : SIGTERM);
+    }
+    while(waitpid(-1, NULL, 0) > 0 || errno == EINTR);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+out:
+    free(pids);
+    free(started);
+    free(respawn);
+    free(failures);
+    return ret;
+}
+
+static void usage(char* prog)
+{
+    printf("Usage: %s [options] wsgi\n"
+           "  -H, --host HOST          bind address, IPv4 or IPv6 (default 127.0.0.1)\n"
+           "  -p, --port PORT          bind port (default 8000)\n"
+           "  -w, --workers N          prefork N worker processes (default 1)\n"
+           "  -t, --threads N          event loop threads per process (default 1)\n"
+           "  -a, --app-threads N      call the app in a pool of N threads per\n"
+           "                           process while the event loops go on with\n"
+           "                           other connections (default 0 = in the loop)\n"
+           "  -b, --accept-batch N     max. accepts per wakeup (default %d)\n"
+           "  -c, --max-connections N  max. open connections per worker, further\n"
+           "                           ones wait in the listen backlog (default\n"
+           "                           0 = unlimited)\n"
+           "  -i, --input-spill BYTES  buffer larger request bodies in a temporary\n"
+           "                           file, 0 = never (default %d)\n"
+           "  -W, --write-budget BYTES collect response iterator items up to this\n"
+           "                           size into one write (default %d)\n"
+           "  -e, --early-dispatch     call the app once the headers are parsed,\n"
+           "                           wsgi.input streams the body (with -a;\n"
+           "                           without, the body is buffered first)\n"
+           "  -s, --static PREFIX=DIR  answer GET and HEAD requests for PREFIX/...\n"
+           "                           with the files in DIR, without the app;\n"
+           "                           FILE.br, .zst and .gz are sent instead of\n"
+           "                           FILE to clients accepting them; may be\n"
+           "                           given several times\n"
+           "  -z, --precompressed      likewise for wsgi.file_wrapper responses\n"
+#ifdef WANT_IO_URING
+           "      --io-uring           accept and receive through io_uring (Linux\n"
+           "                           5.19+), falls back to libev if unavailable\n"
+#endif
+           "Timeouts in seconds, 0 = none:\n"
+           "      --read-timeout N     until the first request starts (default %d)\n"
+           "      --header-timeout N   for all of the request headers (default %d)\n"
+           "      --body-timeout N     between reads of the request body (default %d)\n"
+           "      --write-timeout N    between writes of the response (default %d)\n"
+           "      --keepalive-timeout N\n"
+           "                           idle between requests (default %d)\n",
+           prog, DEFAULT_ACCEPT_BATCH, DEFAULT_INPUT_SPILL_THRESHOLD,
+           DEFAULT_WRITE_BUDGET, DEFAULT_READ_TIMEOUT, DEFAULT_HEADER_TIMEOUT,
+           DEFAULT_BODY_TIMEOUT, DEFAULT_WRITE_TIMEOUT, DEFAULT_KEEPALIVE_TIMEOUT);
+}
+
+/* `short_name` may be NULL for options that only have a long form */
+static int is_option(char* arg, char* short_name, char* long_name)
+{
+    return (short_name && !strcmp(arg, short_name)) || !strcmp(arg, long_name);
+}
+
+/* Parse the integer value of the option at argv[*i], which must be >= min */
+static int option_int(int argc, char** argv, int* i, int min, int* value)
+{
+    if(*i + 1 >= argc) {
+        printf("Error: %s requires a value\n", argv[*i]);
+        return -1;
+    }
+    *value = atoi(argv[++*i]);
+    if(*value < min) {
+        printf("Error: %s must be >= %d\n", argv[*i - 1], min);
+        return -1;
+    }
+    return 0;
+}
+
+/* -s PREFIX=DIR: add a static route. Routes are kept longest prefix first,
+ * so that the most specific one matches. */
+static int option_static(int argc, char** argv, int* i)
+{
+    if(*i + 1 >= argc) {
+        printf("Error: %s requires a value\n", argv[*i]);
+        return -1;
+    }
+    char* prefix = argv[++*i];
+    char* root = strchr(prefix, '=');
+    if(prefix[0] != '/' || root == NULL || root[1] == '\0') {
+        printf("Error: %s must be PREFIX=DIR, with PREFIX starting with '/'\n", argv[*i - 1]);
+        return -1;
+    }
+    *root++ = '\0';
+    struct stat st;
+    if(stat(root, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        printf("Error: %s is not a directory\n", root);
+        return -1;
+    }
+
+    StaticRoute route = { prefix, strlen(prefix), root, strlen(root) };
+    while(route.prefix_len && route.prefix[route.prefix_len - 1] == '/')
+        route.prefix_len--;
+    while(route.root_len && route.root[route.root_len - 1] == '/')
+        route.root_len--;
+
+    int count = server_options.static_route_count;
+    StaticRoute* routes = realloc(server_options.static_routes, (count + 1) * sizeof(StaticRoute));
+    if(routes == NULL) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    int pos = count;
+    while(pos > 0 && routes[pos - 1].prefix_len < route.prefix_len) {
+        routes[pos] = routes[pos - 1];
+        pos--;
+    }
+    routes[pos] = route;
+    server_options.static_routes = routes;
+    server_options.static_route_count = count + 1;
+    return 0;
+}
+
 int main(int argc, char** argv) {
-    int fd = 0;
+    int fd = -1;
+    int status = 0;
+    int workers = 1;
+    char* host = "127.0.0.1";
+    int port = 8000;
+    char* wsgi = NULL;
 
     PyObject *pApp = NULL;
 
-    if(argc < 2) {
-        printf("Usage: %s wsgi\n", argv[0]);
+    for(int i = 1; i < argc; i++) {
+        int err = 0;
+        if(is_option(argv[i], "-H", "--host")) {
+            if(i + 1 >= argc)
+                err = -1;
+            else
+                host = argv[++i];
+        }
+        else if(is_option(argv[i], "-p", "--port"))
+            err = option_int(argc, argv, &i, 1, &port);
+        else if(is_option(argv[i], "-w", "--workers"))
+            err = option_int(argc, argv, &i, 1, &workers);
+        else if(is_option(argv[i], "-t", "--threads"))
+            err = option_int(argc, argv, &i, 1, &server_options.threads);
+        else if(is_option(argv[i], "-a", "--app-threads"))
+            err = option_int(argc, argv, &i, 0, &server_options.app_threads);
+        else if(is_option(argv[i], "-b", "--accept-batch"))
+            err = option_int(argc, argv, &i, 1, &server_options.accept_batch);
+        else if(is_option(argv[i], "-c", "--max-connections"))
+            err = option_int(argc, argv, &i, 0, &server_options.max_connections);
+        else if(is_option(argv[i], "-i", "--input-spill"))
+            err = option_int(argc, argv, &i, 0, &server_options.input_spill_threshold);
+        else if(is_option(argv[i], "-W", "--write-budget"))
+            err = option_int(argc, argv, &i, 1, &server_options.write_budget);
+        else if(is_option(argv[i], "-e", "--early-dispatch"))
+            server_options.early_dispatch = 1;
+        else if(is_option(argv[i], "-s", "--static"))
+            err = option_static(argc, argv, &i);
+        else if(is_option(argv[i], "-z", "--precompressed"))
+            server_options.precompressed = 1;
+#ifdef WANT_IO_URING
+        else if(is_option(argv[i], NULL, "--io-uring"))
+            server_options.io_uring = 1;
+#endif
+        else if(is_option(argv[i], NULL, "--read-timeout"))
+            err = option_int(argc, argv, &i, 0, &server_options.read_timeout);
+        else if(is_option(argv[i], NULL, "--header-timeout"))
+            err = option_int(argc, argv, &i, 0, &server_options.header_timeout);
+        else if(is_option(argv[i], NULL, "--body-timeout"))
+            err = option_int(argc, argv, &i, 0, &server_options.body_timeout);
+        else if(is_option(argv[i], NULL, "--write-timeout"))
+            err = option_int(argc, argv, &i, 0, &server_options.write_timeout);
+        else if(is_option(argv[i], NULL, "--keepalive-timeout"))
+            err = option_int(argc, argv, &i, 0, &server_options.keepalive_timeout);
+        else if(argv[i][0] == '-')
+            err = -1;
+        else
+            wsgi = argv[i];
+
+        if(err) {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if(wsgi == NULL) {
+        usage(argv[0]);
         return -1;
     }
 
-    fd = makeCSocket("", "127.0.0.1", 8000);
+    if(server_options.app_threads == 0) {
+        /* The app would wait for the request body in the event loop
+         * thread; call it once the body has been buffered instead */
+        server_options.early_dispatch = 0;
+    }
 
-    if(fd < 0) {
-        return -1;
+    if(workers > 1) {
+        /* Only a check that the workers will be able to bind; without
+         * listen() it doesn't take connections away from them */
+        fd = bindCSocket("", host, port);
+        if(fd < 0)
+            return -1;
+        close(fd);
+        fd = -1;
+    }
+    else {
+        fd = makeCSocket("", host, port);
+        if(fd < 0)
+            return -1;
     }
     
     Py_Initialize();
@@ -183,12 +584,25 @@ int main(int argc, char** argv) {
     
     goto try;
 try:
-    pApp = makeApp(argv[1]);
+    pApp = makeApp(wsgi);
     if(pApp == NULL)
         goto error;
+
+#ifdef Py_GIL_DISABLED
+    /* Importing an extension module that doesn't support free-threading
+     * turns the GIL back on, and the app calls are serialized again */
+    if(server_options.threads > 1 || server_options.app_threads > 0)
+        PyRun_SimpleString("import sys\n"
+                           "if sys._is_gil_enabled():\n"
+                           "    print('Warning: the GIL is enabled, app calls do not run in parallel',\n"
+                           "          file=sys.stderr)\n");
+#endif
     //Py_INCREF(pApp);
 
-    run(pApp, fd, "127.0.0.1", 8000);
+    if(workers > 1)
+        status = supervise_workers(pApp, workers, host, port);
+    else
+        run(pApp, fd, host, port);
     if(PyErr_Occurred())
         PyErr_Print();
 
@@ -198,11 +612,13 @@ try:
 
 finally:
     Py_DECREF(pApp);
-    close(fd);
-    return 0;
+    if(fd >= 0)
+        close(fd);
+    return status;
 
 error:
     Py_XDECREF(pApp);
-    close(fd);
+    if(fd >= 0)
+        close(fd);
     return -1;
 }
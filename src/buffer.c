@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+
+#define NEXT_FREE(buf) (*(char**)(buf))
+
+void BufferPool_init(BufferPool* pool)
+{
+    memset(pool, 0, sizeof(BufferPool));
+}
+
+void BufferPool_destroy(BufferPool* pool)
+{
+    for(int i = 0; i < BUFFER_CLASSES; ++i) {
+        while(pool->free_list[i]) {
+            char* buf = pool->free_list[i];
+            pool->free_list[i] = NEXT_FREE(buf);
+            free(buf);
+        }
+        pool->free_count[i] = 0;
+    }
+    pool->free_bytes = 0;
+}
+
+/* Returns a buffer of BUFFER_CLASS_SIZE(size_class) bytes, or NULL */
+char* BufferPool_get(BufferPool* pool, int size_class)
+{
+    size_t size = BUFFER_CLASS_SIZE(size_class);
+    char* buf = pool->free_list[size_class];
+    if(buf) {
+        pool->free_list[size_class] = NEXT_FREE(buf);
+        pool->free_count[size_class]--;
+        pool->free_bytes -= size;
+        pool->hits++;
+    } else {
+        buf = malloc(size);
+        if(buf == NULL)
+            return NULL;
+        pool->misses++;
+    }
+    pool->in_use[size_class]++;
+    pool->in_use_bytes += size;
+    if(pool->in_use_bytes > pool->high_water_bytes)
+        pool->high_water_bytes = pool->in_use_bytes;
+    return buf;
+}
+
+void BufferPool_put(BufferPool* pool, int size_class, char* buf)
+{
+    size_t size = BUFFER_CLASS_SIZE(size_class);
+    pool->in_use[size_class]--;
+    pool->in_use_bytes -= size;
+    if(pool->free_bytes + size <= BUFFER_POOL_MAX_FREE) {
+        NEXT_FREE(buf) = pool->free_list[size_class];
+        pool->free_list[size_class] = buf;
+        pool->free_count[size_class]++;
+        pool->free_bytes += size;
+    } else {
+        free(buf);
+    }
+}
+
+void BufferPool_print_stats(BufferPool* pool, FILE* out)
+{
+    fprintf(out, "read buffers: hits=%lu misses=%lu in_use=%zu/%zu/%zu in_use_bytes=%zu "
+            "high_water_bytes=%zu free_bytes=%zu\n",
+            pool->hits, pool->misses, pool->in_use[0], pool->in_use[1], pool->in_use[2],
+            pool->in_use_bytes, pool->high_water_bytes, pool->free_bytes);
+}
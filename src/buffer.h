@@ -0,0 +1,33 @@
+#ifndef __buffer_h__
+#define __buffer_h__
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Read buffers come in three size classes: 4, 16 and 64 KiB */
+#define BUFFER_CLASSES 3
+#define BUFFER_CLASS_SIZE(class) ((size_t)4096 << (2 * (class)))
+
+/* Free buffers beyond this many bytes are returned to the system */
+#define BUFFER_POOL_MAX_FREE (4*1024*1024)
+
+/* Per-loop cache of read buffers. Free buffers are chained through their
+ * first bytes. */
+typedef struct {
+    char* free_list[BUFFER_CLASSES];
+    size_t free_count[BUFFER_CLASSES];
+    size_t in_use[BUFFER_CLASSES];
+    size_t in_use_bytes;
+    size_t free_bytes;
+    size_t high_water_bytes;
+    unsigned long hits;
+    unsigned long misses;
+} BufferPool;
+
+void BufferPool_init(BufferPool*);
+void BufferPool_destroy(BufferPool*);
+char* BufferPool_get(BufferPool*, int size_class);
+void BufferPool_put(BufferPool*, int size_class, char* buf);
+void BufferPool_print_stats(BufferPool*, FILE*);
+
+#endif
@@ -30,8 +30,11 @@ size_t unquote_url_inplace(char* url, size_t len)
 void _init_common()
 {
 
-#define _(name) _##name = _PEP3333_String_FromUTF8String(#name)
+/* Interned strings are immortal (on Python 3.12+), so threads can share
+ * them without contending for their reference counts */
+#define _(name) _##name = _PEP3333_String_InternFromString(#name)
     _(REMOTE_ADDR);
+    _(REMOTE_PORT);
     _(PATH_INFO);
     _(QUERY_STRING);
     _(close);
@@ -45,18 +48,19 @@ void _init_common()
     _(CONTENT_LENGTH);
     _(HTTP_CONTENT_TYPE);
     _(CONTENT_TYPE);
+    _(HTTP_RANGE);
+    _(HTTP_IF_RANGE);
+    _(HTTP_ACCEPT_ENCODING);
     _(HTTP_);
     _(http);
 
-    _(BytesIO);
-    _(write);
     _(read);
-    _(seek);
+    _(name);
 #undef _
 
-    _HTTP_1_1 = _PEP3333_String_FromUTF8String("HTTP/1.1");
-    _HTTP_1_0 = _PEP3333_String_FromUTF8String("HTTP/1.0");
-    _wsgi_input = _PEP3333_String_FromUTF8String("wsgi.input");
-    _empty_string = _PEP3333_String_FromUTF8String("");
+    _HTTP_1_1 = _PEP3333_String_InternFromString("HTTP/1.1");
+    _HTTP_1_0 = _PEP3333_String_InternFromString("HTTP/1.0");
+    _wsgi_input = _PEP3333_String_InternFromString("wsgi.input");
+    _empty_string = _PEP3333_String_InternFromString("");
     _empty_bytes = _PEP3333_Bytes_FromString("");
 }
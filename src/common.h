@@ -22,11 +22,12 @@ enum my_http_status { HTTP_BAD_REQUEST = 1, HTTP_LENGTH_REQUIRED, HTTP_SERVER_ER
 size_t unquote_url_inplace(char* url, size_t len);
 void _init_common(void);
 
-PyObject* _REMOTE_ADDR, *_PATH_INFO, *_QUERY_STRING, *_REQUEST_METHOD, *_GET,
+PyObject* _REMOTE_ADDR, *_REMOTE_PORT, *_PATH_INFO, *_QUERY_STRING, *_REQUEST_METHOD, *_GET,
           *_HTTP_CONTENT_LENGTH, *_CONTENT_LENGTH, *_HTTP_CONTENT_TYPE,
-          *_CONTENT_TYPE, *_SERVER_PROTOCOL, *_SERVER_NAME, *_SERVER_PORT,
+          *_CONTENT_TYPE, *_HTTP_RANGE, *_HTTP_IF_RANGE, *_HTTP_ACCEPT_ENCODING,
+          *_SERVER_PROTOCOL, *_SERVER_NAME, *_SERVER_PORT,
           *_http, *_HTTP_, *_HTTP_1_1, *_HTTP_1_0, *_wsgi_input, *_close,
-          *_empty_string, *_empty_bytes, *_BytesIO, *_write, *_read, *_seek;
+          *_empty_string, *_empty_bytes, *_read, *_name;
 
 #ifdef DEBUG
 #define DBG_REQ(request, ...) \
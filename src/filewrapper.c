@@ -1,3 +1,4 @@
+#include <sys/stat.h>
 #include "filewrapper.h"
 #include "py2py3.h"
 
@@ -8,6 +9,11 @@ int FileWrapper_GetFd(PyObject* self)
     return FW_self->fd;
 }
 
+Py_ssize_t FileWrapper_GetSendfileCount(PyObject* self)
+{
+    return FW_self->sendfile_count;
+}
+
 void FileWrapper_Done(PyObject* self)
 {
     if (FW_self->fd != -1) {
@@ -24,12 +30,26 @@ FileWrapper_New(PyTypeObject* cls, PyObject* args, PyObject* kwargs)
     if(!PyArg_ParseTuple(args, "O|O:FileWrapper", &file, &blocksize))
         return NULL;
 
+    /* An integer blocksize also limits how much one sendfile() call sends */
+    Py_ssize_t sendfile_count = 0;
+    if(blocksize && PyIndex_Check(blocksize)) {
+        sendfile_count = PyNumber_AsSsize_t(blocksize, NULL);
+        if(sendfile_count == -1 && PyErr_Occurred())
+            return NULL;
+        if(sendfile_count < 0)
+            sendfile_count = 0;
+    }
+
     Py_INCREF(file);
     Py_XINCREF(blocksize);
 
     int fd = PyObject_AsFileDescriptor(file);
+    struct stat st;
     if (fd == -1) {
         PyErr_Clear();
+    } else if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        /* sendfile() needs a regular file; pipes etc. are read() */
+        fd = -1;
     } else {
         PyFile_IncUseCount((PyFileObject*)file);
     }
@@ -37,6 +57,7 @@ FileWrapper_New(PyTypeObject* cls, PyObject* args, PyObject* kwargs)
     FileWrapper* wrapper = PyObject_NEW(FileWrapper, cls);
     wrapper->file = file;
     wrapper->blocksize = blocksize;
+    wrapper->sendfile_count = sendfile_count;
     wrapper->fd = fd;
 
     return (PyObject*)wrapper;
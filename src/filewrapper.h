@@ -8,9 +8,11 @@ typedef struct {
     PyObject_HEAD
     PyObject* file;
     PyObject* blocksize;
+    Py_ssize_t sendfile_count; /* blocksize as a number; 0 = not given */
     int fd;
 } FileWrapper;
 
 void _init_filewrapper(void);
 int FileWrapper_GetFd(PyObject* self);
+Py_ssize_t FileWrapper_GetSendfileCount(PyObject* self);
 void FileWrapper_Done(PyObject* self);
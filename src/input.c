@@ -0,0 +1,443 @@
+#include "input.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "py2py3.h"
+
+#define IN_self ((Input*)self)
+
+PyObject* Input_New(Py_ssize_t spill_threshold)
+{
+    Input* input = PyObject_NEW(Input, &Input_Type);
+    if(input == NULL)
+        return NULL;
+    input->head = NULL;
+    input->tail = NULL;
+    input->head_offset = 0;
+    input->size = 0;
+    input->pos = 0;
+    input->spill_threshold = spill_threshold;
+    input->fd = -1;
+    input->cache = NULL;
+    input->cache_start = 0;
+    input->cache_len = 0;
+    input->complete = false;
+    input->fill = NULL;
+    input->fill_arg = NULL;
+    return (PyObject*)input;
+}
+
+void Input_Finish(PyObject* self)
+{
+    IN_self->complete = true;
+}
+
+/* Set (or, with NULL, remove) the source that is asked for more data */
+void Input_SetSource(PyObject* self, input_fill_func* fill, void* arg)
+{
+    IN_self->fill = fill;
+    IN_self->fill_arg = arg;
+}
+
+/* Have the source deliver the rest of the body, so that later reads don't
+ * need it. Returns 0, or -1 with an exception set. */
+int Input_ReadAll(PyObject* self)
+{
+    while(!IN_self->complete && IN_self->fill) {
+        if(IN_self->fill(IN_self->fill_arg) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+open_spill_file(void)
+{
+    const char* dir = getenv("TMPDIR");
+    if(dir == NULL)
+        dir = "/tmp";
+
+#ifdef O_TMPFILE
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if(fd != -1)
+        return fd;
+#endif
+
+    /* No O_TMPFILE: create a named file and unlink it right away */
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/bjoern-input-XXXXXX", dir);
+    int fd2 = mkstemp(path);
+    if(fd2 != -1) {
+        unlink(path);
+        fcntl(fd2, F_SETFD, FD_CLOEXEC);
+    }
+    return fd2;
+}
+
+static int
+pwrite_all(int fd, const char* data, size_t len, off_t offset)
+{
+    while(len) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Move the unread part of the chunk chain into a temporary file.
+ * File offsets equal stream positions, so already-read data is skipped. */
+static void
+spill(Input* self)
+{
+    int fd = open_spill_file();
+    if(fd == -1) {
+        fprintf(stderr, "Could not create wsgi.input spill file: errno %d\n", errno);
+        self->spill_threshold = 0; /* keep buffering in memory */
+        return;
+    }
+
+    off_t offset = self->pos;
+    input_chunk* chunk = self->head;
+    size_t skip = self->head_offset;
+    while(chunk) {
+        if(pwrite_all(fd, chunk->data + skip, chunk->len - skip, offset) == -1) {
+            fprintf(stderr, "Could not write wsgi.input spill file: errno %d\n", errno);
+            close(fd);
+            self->spill_threshold = 0;
+            return;
+        }
+        offset += chunk->len - skip;
+        skip = 0;
+        chunk = chunk->next;
+    }
+
+    while(self->head) {
+        chunk = self->head;
+        self->head = chunk->next;
+        free(chunk);
+    }
+    self->tail = NULL;
+    self->head_offset = 0;
+    self->fd = fd;
+}
+
+/* Append request body data. Returns 0 on success, -1 with an exception set. */
+int Input_Write(PyObject* self, const char* data, size_t len)
+{
+    if(IN_self->fd == -1 && IN_self->spill_threshold > 0
+       && IN_self->size - IN_self->pos + (Py_ssize_t)len > IN_self->spill_threshold) {
+        spill(IN_self);
+    }
+
+    if(IN_self->fd != -1) {
+        if(pwrite_all(IN_self->fd, data, len, IN_self->size) == -1) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        IN_self->size += len;
+        return 0;
+    }
+
+    input_chunk* tail = IN_self->tail;
+    if(tail && tail->capacity - tail->len >= len) {
+        memcpy(tail->data + tail->len, data, len);
+        tail->len += len;
+    } else {
+        size_t capacity = len > INPUT_CHUNK_SIZE ? len : INPUT_CHUNK_SIZE;
+        input_chunk* chunk = malloc(sizeof(input_chunk) + capacity);
+        if(chunk == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        chunk->next = NULL;
+        chunk->len = len;
+        chunk->capacity = capacity;
+        memcpy(chunk->data, data, len);
+        if(tail)
+            tail->next = chunk;
+        else
+            IN_self->head = chunk;
+        IN_self->tail = chunk;
+    }
+    IN_self->size += len;
+    return 0;
+}
+
+/* Point `*data` to the contiguous bytes at the read position.
+ * Returns their number, 0 on EOF or -1 with an exception set. */
+static Py_ssize_t
+input_peek(Input* self, const char** data)
+{
+    while(self->pos >= self->size) {
+        if(self->complete || self->fill == NULL)
+            return 0;
+        if(self->fill(self->fill_arg) == -1)
+            return -1;
+    }
+
+    if(self->fd != -1) {
+        if(self->pos < self->cache_start || self->pos >= self->cache_start + self->cache_len) {
+            if(self->cache == NULL && (self->cache = malloc(INPUT_CHUNK_SIZE)) == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            ssize_t n;
+            do {
+                n = pread(self->fd, self->cache, INPUT_CHUNK_SIZE, self->pos);
+            } while(n == -1 && errno == EINTR);
+            if(n <= 0) {
+                if(n == 0)
+                    errno = EIO; /* file shorter than what we wrote */
+                PyErr_SetFromErrno(PyExc_IOError);
+                return -1;
+            }
+            self->cache_start = self->pos;
+            self->cache_len = n;
+        }
+        *data = self->cache + (self->pos - self->cache_start);
+        return self->cache_start + self->cache_len - self->pos;
+    }
+
+    /* Chunks are freed as soon as they have been read completely */
+    while(self->head_offset == self->head->len) {
+        input_chunk* chunk = self->head;
+        self->head = chunk->next;
+        if(self->head == NULL)
+            self->tail = NULL;
+        self->head_offset = 0;
+        free(chunk);
+    }
+    *data = self->head->data + self->head_offset;
+    return self->head->len - self->head_offset;
+}
+
+static inline void
+input_consume(Input* self, Py_ssize_t n)
+{
+    self->pos += n;
+    if(self->fd == -1)
+        self->head_offset += n;
+}
+
+static PyObject*
+input_read(Input* self, Py_ssize_t size)
+{
+    /* Pull in as much of the body as the read asks for */
+    while(!self->complete && self->fill
+          && (size < 0 || self->size - self->pos < size)) {
+        if(self->fill(self->fill_arg) == -1)
+            return NULL;
+    }
+
+    Py_ssize_t remaining = self->size - self->pos;
+    if(size < 0 || size > remaining)
+        size = remaining;
+
+    PyObject* result = _PEP3333_Bytes_FromStringAndSize(NULL, size);
+    if(result == NULL)
+        return NULL;
+
+    char* out = (char*)_PEP3333_Bytes_AS_DATA(result);
+    while(size) {
+        const char* data;
+        Py_ssize_t n = input_peek(self, &data);
+        if(n <= 0) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        if(n > size)
+            n = size;
+        memcpy(out, data, n);
+        input_consume(self, n);
+        out += n;
+        size -= n;
+    }
+    return result;
+}
+
+static PyObject*
+input_readline(Input* self, Py_ssize_t size)
+{
+    PyObject* result = NULL;
+    Py_ssize_t result_len = 0;
+
+    if(size < 0)
+        size = PY_SSIZE_T_MAX;
+
+    while(result_len < size) {
+        const char* data;
+        Py_ssize_t n = input_peek(self, &data);
+        if(n < 0) {
+            Py_XDECREF(result);
+            return NULL;
+        }
+        if(n == 0)
+            break;
+        if(n > size - result_len)
+            n = size - result_len;
+
+        const char* newline = memchr(data, '\n', n);
+        if(newline)
+            n = newline - data + 1;
+
+        if(result == NULL) {
+            /* Common case: the whole line is in one segment */
+            result = _PEP3333_Bytes_FromStringAndSize(data, n);
+            if(result == NULL)
+                return NULL;
+        } else {
+            /* Line spans several segments. Not resized in place because
+             * short bytes objects may be shared singletons. */
+            PyObject* joined = _PEP3333_Bytes_FromStringAndSize(NULL, result_len + n);
+            if(joined == NULL) {
+                Py_DECREF(result);
+                return NULL;
+            }
+            memcpy((char*)_PEP3333_Bytes_AS_DATA(joined), _PEP3333_Bytes_AS_DATA(result), result_len);
+            memcpy((char*)_PEP3333_Bytes_AS_DATA(joined) + result_len, data, n);
+            Py_DECREF(result);
+            result = joined;
+        }
+        result_len += n;
+        input_consume(self, n);
+
+        if(newline)
+            break;
+    }
+
+    if(result == NULL) {
+        Py_INCREF(_empty_bytes);
+        return _empty_bytes;
+    }
+    return result;
+}
+
+static int
+size_argument(PyObject* args, const char* format, Py_ssize_t* size)
+{
+    PyObject* size_obj = Py_None;
+    if(!PyArg_ParseTuple(args, format, &size_obj))
+        return -1;
+    if(size_obj == Py_None) {
+        *size = -1;
+        return 0;
+    }
+    *size = PyNumber_AsSsize_t(size_obj, PyExc_OverflowError);
+    if(*size == -1 && PyErr_Occurred())
+        return -1;
+    return 0;
+}
+
+static PyObject*
+Input_Read(PyObject* self, PyObject* args)
+{
+    Py_ssize_t size;
+    if(size_argument(args, "|O:read", &size) == -1)
+        return NULL;
+    return input_read(IN_self, size);
+}
+
+static PyObject*
+Input_Readline(PyObject* self, PyObject* args)
+{
+    Py_ssize_t size;
+    if(size_argument(args, "|O:readline", &size) == -1)
+        return NULL;
+    return input_readline(IN_self, size);
+}
+
+static PyObject*
+Input_Readlines(PyObject* self, PyObject* args)
+{
+    Py_ssize_t hint;
+    if(size_argument(args, "|O:readlines", &hint) == -1)
+        return NULL;
+
+    PyObject* lines = PyList_New(0);
+    if(lines == NULL)
+        return NULL;
+
+    Py_ssize_t total = 0;
+    while(hint <= 0 || total < hint) {
+        PyObject* line = input_readline(IN_self, -1);
+        if(line == NULL) {
+            Py_DECREF(lines);
+            return NULL;
+        }
+        if(_PEP3333_Bytes_GET_SIZE(line) == 0) {
+            Py_DECREF(line);
+            break;
+        }
+        total += _PEP3333_Bytes_GET_SIZE(line);
+        int err = PyList_Append(lines, line);
+        Py_DECREF(line);
+        if(err == -1) {
+            Py_DECREF(lines);
+            return NULL;
+        }
+    }
+    return lines;
+}
+
+static PyObject*
+Input_Iter(PyObject* self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject*
+Input_IterNext(PyObject* self)
+{
+    PyObject* line = input_readline(IN_self, -1);
+    if(line != NULL && _PEP3333_Bytes_GET_SIZE(line) == 0) {
+        Py_DECREF(line);
+        return NULL;
+    }
+    return line;
+}
+
+void Input_dealloc(PyObject* self)
+{
+    while(IN_self->head) {
+        input_chunk* chunk = IN_self->head;
+        IN_self->head = chunk->next;
+        free(chunk);
+    }
+    if(IN_self->fd != -1)
+        close(IN_self->fd);
+    free(IN_self->cache);
+    PyObject_FREE(self);
+}
+
+static PyMethodDef Input_methods[] = {
+    {"read", Input_Read, METH_VARARGS, NULL},
+    {"readline", Input_Readline, METH_VARARGS, NULL},
+    {"readlines", Input_Readlines, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+PyTypeObject Input_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "Input",                          /* tp_name (__name__)                     */
+    sizeof(Input),                    /* tp_basicsize                           */
+    0,                                /* tp_itemsize                            */
+    (destructor)Input_dealloc,        /* tp_dealloc                             */
+};
+
+void _init_input(void)
+{
+    Input_Type.tp_iter = Input_Iter;
+    Input_Type.tp_iternext = Input_IterNext;
+    Input_Type.tp_methods = Input_methods;
+    Input_Type.tp_flags |= Py_TPFLAGS_DEFAULT;
+}
@@ -0,0 +1,50 @@
+#include "common.h"
+
+#define Input_CheckExact(x) ((x)->ob_type == &Input_Type)
+
+/* Request bodies are buffered in chunks of at least this size */
+#define INPUT_CHUNK_SIZE (16*1024)
+
+PyTypeObject Input_Type;
+
+typedef struct input_chunk {
+    struct input_chunk* next;
+    size_t len;
+    size_t capacity;
+    char data[];
+} input_chunk;
+
+/* Called when a read needs more data than is buffered and the body is not
+ * complete yet; must Input_Write() more data (or Input_Finish()) and return
+ * 0, or set an exception and return -1. */
+typedef int input_fill_func(void* arg);
+
+/* `wsgi.input`: a read-only file-like object over the request body.
+ * The body is kept in a chain of memory chunks; once more than
+ * `spill_threshold` unread bytes (0 = never) are buffered it's moved to an
+ * anonymous temporary file so that large uploads don't have to fit in
+ * memory. With a `fill` source, reads may block for more body data
+ * (see ServerInfo.early_dispatch). */
+typedef struct {
+    PyObject_HEAD
+    input_chunk* head;
+    input_chunk* tail;
+    size_t head_offset;   /* read offset into `head` */
+    Py_ssize_t size;      /* bytes written so far */
+    Py_ssize_t pos;       /* bytes read so far */
+    Py_ssize_t spill_threshold;
+    int fd;               /* spill file, or -1 */
+    char* cache;          /* read cache for the spill file */
+    Py_ssize_t cache_start;
+    Py_ssize_t cache_len;
+    bool complete;        /* no more Input_Write()s will follow */
+    input_fill_func* fill;
+    void* fill_arg;
+} Input;
+
+void _init_input(void);
+PyObject* Input_New(Py_ssize_t spill_threshold);
+int Input_Write(PyObject* self, const char* data, size_t len);
+void Input_Finish(PyObject* self);
+void Input_SetSource(PyObject* self, input_fill_func* fill, void* arg);
+int Input_ReadAll(PyObject* self);
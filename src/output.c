@@ -0,0 +1,159 @@
+#include "output.h"
+#include <errno.h>
+#include <stdio.h>
+#include "py2py3.h"
+
+OutputQueue* OutputQueue_new(void)
+{
+    OutputQueue* queue = malloc(sizeof(OutputQueue));
+    if(queue == NULL)
+        return NULL;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->size = 0;
+    return queue;
+}
+
+void OutputQueue_clear(OutputQueue* queue)
+{
+    for(int i = queue->head; i < queue->tail; ++i)
+        Py_XDECREF(queue->slots[i].owner);
+    queue->head = 0;
+    queue->tail = 0;
+    queue->size = 0;
+}
+
+void OutputQueue_free(OutputQueue* queue)
+{
+    OutputQueue_clear(queue);
+    free(queue);
+}
+
+/* Number of buffers that can still be pushed */
+int OutputQueue_space(OutputQueue* queue)
+{
+    return OUTPUT_QUEUE_SIZE - (queue->tail - queue->head);
+}
+
+/* True if any of the unsent buffers belongs to a Python object, which
+ * means sending (or clearing) the queue needs the GIL */
+bool OutputQueue_has_owners(OutputQueue* queue)
+{
+    for(int i = queue->head; i < queue->tail; ++i) {
+        if(queue->slots[i].owner)
+            return true;
+    }
+    return false;
+}
+
+/* Make sure `n` more buffers fit behind `tail` */
+static void
+reserve(OutputQueue* queue, int n)
+{
+    assert(OutputQueue_space(queue) >= n);
+    if(queue->tail + n <= OUTPUT_QUEUE_SIZE)
+        return;
+
+    /* Move the unsent buffers to the front */
+    int count = queue->tail - queue->head;
+    for(int i = 0; i < count; ++i) {
+        struct iovec iov = queue->iov[queue->head + i];
+        char* old_line = queue->slots[queue->head + i].size_line;
+        if((char*)iov.iov_base >= old_line && (char*)iov.iov_base < old_line + CHUNK_SIZE_LINE_MAX) {
+            /* Size lines live in their slot, so they move along */
+            memcpy(queue->slots[i].size_line, old_line, CHUNK_SIZE_LINE_MAX);
+            iov.iov_base = queue->slots[i].size_line + ((char*)iov.iov_base - old_line);
+        }
+        queue->slots[i].owner = queue->slots[queue->head + i].owner;
+        queue->iov[i] = iov;
+    }
+    queue->head = 0;
+    queue->tail = count;
+}
+
+static inline void
+push(OutputQueue* queue, const char* data, size_t len, PyObject* owner)
+{
+    queue->iov[queue->tail].iov_base = (void*)data;
+    queue->iov[queue->tail].iov_len = len;
+    queue->slots[queue->tail].owner = owner;
+    queue->tail++;
+    queue->size += len;
+}
+
+/* Append `len` bytes at `data`. Steals the reference to `owner`, which
+ * must keep `data` alive until it's been sent. */
+void OutputQueue_push(OutputQueue* queue, const char* data, size_t len, PyObject* owner)
+{
+    reserve(queue, 1);
+    push(queue, data, len, owner);
+}
+
+/* Append `n` response body chunks. If `chunked`, they are framed as one
+ * single HTTP chunk. Steals the references to the `chunks`. */
+void OutputQueue_push_chunks(OutputQueue* queue, PyObject** chunks, int n, bool chunked)
+{
+    size_t total = 0;
+    for(int i = 0; i < n; ++i)
+        total += _PEP3333_Bytes_GET_SIZE(chunks[i]);
+    assert(total);
+
+    reserve(queue, chunked ? n + 2 : n);
+    if(chunked) {
+        /* Who the hell decided to use decimal representation for Content-Length
+         * but hexadecimal representation for chunk lengths btw!?! Fuck W3C */
+        char* size_line = queue->slots[queue->tail].size_line;
+        size_t len = snprintf(size_line, CHUNK_SIZE_LINE_MAX, "%zx\r\n", total);
+        push(queue, size_line, len, NULL);
+    }
+    for(int i = 0; i < n; ++i)
+        push(queue, _PEP3333_Bytes_AS_DATA(chunks[i]), _PEP3333_Bytes_GET_SIZE(chunks[i]), chunks[i]);
+    if(chunked)
+        push(queue, "\r\n", 2, NULL);
+}
+
+/* Write as much of the queue as the socket takes. Returns the number of
+ * bytes written, or -1 with `errno` set. */
+static ssize_t
+write_queue(OutputQueue* queue, int fd)
+{
+    ssize_t sent;
+    do {
+        sent = writev(fd, queue->iov + queue->head, queue->tail - queue->head);
+    } while(sent == -1 && errno == EINTR);
+    return sent;
+}
+
+ssize_t OutputQueue_send(OutputQueue* queue, int fd)
+{
+    ssize_t sent;
+    if(PyGILState_Check()) {
+        /* The buffers are kept alive by their owners, so the GIL can be
+         * released while writing */
+        Py_BEGIN_ALLOW_THREADS
+        sent = write_queue(queue, fd);
+        Py_END_ALLOW_THREADS
+    } else {
+        /* Static file responses are sent without the GIL */
+        sent = write_queue(queue, fd);
+    }
+    if(sent == -1)
+        return -1;
+
+    queue->size -= sent;
+    size_t left = sent;
+    while(queue->head < queue->tail) {
+        struct iovec* iov = &queue->iov[queue->head];
+        if(left < iov->iov_len) {
+            iov->iov_base = (char*)iov->iov_base + left;
+            iov->iov_len -= left;
+            break;
+        }
+        left -= iov->iov_len;
+        Py_XDECREF(queue->slots[queue->head].owner);
+        queue->head++;
+    }
+    if(queue->head == queue->tail)
+        queue->head = queue->tail = 0;
+    return sent;
+}
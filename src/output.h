@@ -0,0 +1,42 @@
+#ifndef __output_h__
+#define __output_h__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "common.h"
+
+/* Maximum number of buffers in a response's output queue */
+#define OUTPUT_QUEUE_SIZE 32
+
+/* Room for a chunk size line, e.g. "ffffffff\r\n" */
+#define CHUNK_SIZE_LINE_MAX 18
+
+typedef struct {
+    PyObject* owner; /* object that owns `iov_base`, or NULL for static data */
+    char size_line[CHUNK_SIZE_LINE_MAX];
+} output_slot;
+
+/* Response data waiting to be written to the client: the status line and
+ * headers, body chunks and chunked-encoding framing. The buffers reference
+ * the Python objects they come from rather than copies, and are sent with
+ * a single writev(). */
+typedef struct {
+    struct iovec iov[OUTPUT_QUEUE_SIZE];
+    output_slot slots[OUTPUT_QUEUE_SIZE];
+    int head;    /* first unsent buffer */
+    int tail;    /* one past the last buffer */
+    size_t size; /* unsent bytes */
+} OutputQueue;
+
+#define OutputQueue_EMPTY(q) ((q)->head == (q)->tail)
+
+OutputQueue* OutputQueue_new(void);
+void OutputQueue_free(OutputQueue*);
+void OutputQueue_clear(OutputQueue*);
+int OutputQueue_space(OutputQueue*);
+bool OutputQueue_has_owners(OutputQueue*);
+void OutputQueue_push(OutputQueue*, const char* data, size_t len, PyObject* owner);
+void OutputQueue_push_chunks(OutputQueue*, PyObject** chunks, int n, bool chunked);
+ssize_t OutputQueue_send(OutputQueue*, int fd);
+
+#endif
@@ -2,8 +2,6 @@
 
 #include "portable_sendfile.h"
 
-#define SENDFILE_CHUNK_SIZE 16*1024
-
 #if defined __APPLE__
 
 /* OS X */
@@ -11,9 +9,9 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
-Py_ssize_t portable_sendfile(int out_fd, int in_fd, off_t offset)
+Py_ssize_t portable_sendfile(int out_fd, int in_fd, off_t offset, size_t count)
 {
-    off_t len = SENDFILE_CHUNK_SIZE;
+    off_t len = count;
     if(sendfile(in_fd, out_fd, offset, &len, NULL, 0) == -1) {
         if((errno == EAGAIN || errno == EINTR) && len > 0) {
             return len;
@@ -28,10 +26,10 @@ Py_ssize_t portable_sendfile(int out_fd, int in_fd, off_t offset)
 #include <sys/socket.h>
 #include <sys/types.h>
 
-Py_ssize_t portable_sendfile(int out_fd, int in_fd, off_t offset)
+Py_ssize_t portable_sendfile(int out_fd, int in_fd, off_t offset, size_t count)
 {
     off_t len;
-    if(sendfile(in_fd, out_fd, offset, SENDFILE_CHUNK_SIZE, NULL, &len, 0) == -1) {
+    if(sendfile(in_fd, out_fd, offset, count, NULL, &len, 0) == -1) {
         if((errno == EAGAIN || errno == EINTR) && len > 0) {
             return len;
         }
@@ -46,9 +44,11 @@ Py_ssize_t portable_sendfile(int out_fd, int in_fd, off_t offset)
 
 #include <sys/sendfile.h>
 
-Py_ssize_t portable_sendfile(int out_fd, int in_fd, off_t offset)
+/* With a non-blocking socket the kernel sends as much as fits into the
+ * socket buffer and returns short, so a large count costs nothing extra. */
+Py_ssize_t portable_sendfile(int out_fd, int in_fd, off_t offset, size_t count)
 {
-    return sendfile(out_fd, in_fd, &offset, SENDFILE_CHUNK_SIZE);
+    return sendfile(out_fd, in_fd, &offset, count);
 }
 
 #endif
@@ -1,4 +1,7 @@
 #include <sys/types.h> /* for off_t */
 #include <Python.h> /* for Py_ssize_t */
 
-Py_ssize_t portable_sendfile(int out_fd, int in_fd, off_t offset);
+/* Largest count to ask for in one call (Linux never sends more at once) */
+#define SENDFILE_MAX_COUNT 0x7ffff000
+
+Py_ssize_t portable_sendfile(int out_fd, int in_fd, off_t offset, size_t count);
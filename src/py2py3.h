@@ -14,10 +14,12 @@
 #define _PEP3333_Bytes_Resize(bytes, len) _PyBytes_Resize(bytes, len)
 #define _PEP3333_BytesLatin1_FromUnicode(u) PyUnicode_AsLatin1String(u)
 #define _PEP3333_String_FromUTF8String(data) PyUnicode_FromString(data)
+#define _PEP3333_String_InternFromString(data) PyUnicode_InternFromString(data)
 #define _PEP3333_String_FromLatin1StringAndSize(data, len) PyUnicode_DecodeLatin1(data, len, "replace")
 #define _PEP3333_String_FromFormat(...) PyUnicode_FromFormat(__VA_ARGS__)
 #define _PEP3333_String_GET_SIZE(u) PyUnicode_GET_LENGTH(u)
 #define _PEP3333_String_Concat(u1, u2) PyUnicode_Concat(u1, u2)
+#define _PEP3333_FSPath(s) (PyUnicode_Check(s) ? PyUnicode_EncodeFSDefault(s) : NULL)
 
 #else
 
@@ -30,8 +32,10 @@
 #define _PEP3333_Bytes_Resize(bytes, len) _PyString_Resize(bytes, len)
 #define _PEP3333_BytesLatin1_FromUnicode(u) (Py_INCREF(u),u)
 #define _PEP3333_String_FromUTF8String(data) PyString_FromString(data) // Assume UTF8
+#define _PEP3333_String_InternFromString(data) PyString_InternFromString(data)
 #define _PEP3333_String_FromFormat(...) PyString_FromFormat(__VA_ARGS__)
 #define _PEP3333_String_GET_SIZE(u) PyString_GET_SIZE(u)
+#define _PEP3333_FSPath(s) (PyString_Check(s) ? (Py_INCREF(s), s) : NULL)
 
 static PyObject* _PEP3333_String_FromLatin1StringAndSize(const char* data, Py_ssize_t len)
 {
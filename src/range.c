@@ -0,0 +1,103 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <strings.h>
+#include "range.h"
+
+/* Parse a decimal number; returns false if there's none or it's too long
+ * to be a file offset (18 digits always fit into a 64 bit off_t) */
+static bool
+parse_number(const char** p, const char* end, off_t* number)
+{
+    const char* s = *p;
+    off_t n = 0;
+    while(s < end && isdigit((unsigned char)*s)) {
+        if(s - *p == 18)
+            return false;
+        n = n * 10 + (*s++ - '0');
+    }
+    if(s == *p)
+        return false;
+    *p = s;
+    *number = n;
+    return true;
+}
+
+static void
+skip_whitespace(const char** p, const char* end)
+{
+    while(*p < end && (**p == ' ' || **p == '\t'))
+        ++*p;
+}
+
+/* Parse a "Range: bytes=..." header value for a file of `size` bytes into
+ * at most MAX_RANGES ranges, clipped to the file. Ranges that start beyond
+ * the end of the file are dropped; if none is left the set is
+ * unsatisfiable. */
+int Range_parse(const char* spec, size_t len, off_t size,
+                byte_range* ranges, int* count)
+{
+    const char* p = spec;
+    const char* end = spec + len;
+    int n = 0;
+    int specs = 0;
+
+    if(len < 6 || strncasecmp(p, "bytes=", 6))
+        return RANGE_IGNORE;
+    p += 6;
+
+    while(true) {
+        off_t first, last;
+        skip_whitespace(&p, end);
+        if(p < end && *p == ',') {
+            /* Empty list elements are allowed */
+            ++p;
+            continue;
+        }
+        if(p == end)
+            break;
+
+        if(*p == '-') {
+            /* Suffix range: the last `last` bytes */
+            ++p;
+            if(!parse_number(&p, end, &last))
+                return RANGE_IGNORE;
+            if(last == 0)
+                goto next; /* unsatisfiable */
+            first = last < size ? size - last : 0;
+            last = size - 1;
+        } else {
+            if(!parse_number(&p, end, &first) || p == end || *p++ != '-')
+                return RANGE_IGNORE;
+            if(p < end && isdigit((unsigned char)*p)) {
+                if(!parse_number(&p, end, &last) || last < first)
+                    return RANGE_IGNORE;
+                if(last >= size)
+                    last = size - 1;
+            } else {
+                last = size - 1;
+            }
+        }
+        if(first < size) {
+            if(n == MAX_RANGES)
+                return RANGE_IGNORE;
+            ranges[n].start = first;
+            ranges[n].end = last + 1;
+            ++n;
+        }
+
+next:
+        ++specs;
+        skip_whitespace(&p, end);
+        if(p == end)
+            break;
+        if(*p++ != ',')
+            return RANGE_IGNORE;
+    }
+
+    if(specs == 0)
+        return RANGE_IGNORE;
+    if(n == 0)
+        return RANGE_UNSATISFIABLE;
+    *count = n;
+    return RANGE_OK;
+}
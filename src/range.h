@@ -0,0 +1,24 @@
+#ifndef __range_h__
+#define __range_h__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Requests for more ranges than this are answered with the whole file */
+#define MAX_RANGES 16
+
+typedef struct {
+    off_t start;
+    off_t end; /* exclusive */
+} byte_range;
+
+enum {
+    RANGE_IGNORE,       /* not a valid bytes range set; send the whole file */
+    RANGE_OK,
+    RANGE_UNSATISFIABLE /* 416 */
+};
+
+int Range_parse(const char* spec, size_t len, off_t size,
+                byte_range* ranges, int* count);
+
+#endif
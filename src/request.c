@@ -1,25 +1,95 @@
 #include <Python.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 #include "request.h"
 #include "filewrapper.h"
+#include "input.h"
 
 #include "py2py3.h"
 
 static inline void PyDict_ReplaceKey(PyObject* dict, PyObject* k1, PyObject* k2);
 static llhttp_settings_t parser_settings;
-static PyObject* wsgi_base_dict = NULL;
 
-static PyObject* IO_module;
+#define NEXT_FREE_OUTPUT(queue) (*(OutputQueue**)(queue))
 
-Request* Request_new(ServerInfo* server_info, int client_fd, const char* client_addr)
+
+void RequestPool_init(RequestPool* pool)
+{
+    memset(pool, 0, sizeof(RequestPool));
+}
+
+void RequestPool_destroy(RequestPool* pool)
+{
+    while(pool->free_list) {
+        Request* request = pool->free_list;
+        pool->free_list = request->next_free;
+        free(request);
+    }
+    pool->free_count = 0;
+    while(pool->free_outputs) {
+        OutputQueue* queue = pool->free_outputs;
+        pool->free_outputs = NEXT_FREE_OUTPUT(queue);
+        free(queue);
+    }
+    pool->free_output_count = 0;
+}
+
+void RequestPool_print_stats(RequestPool* pool, FILE* out)
 {
-    Request* request = malloc(sizeof(Request));
+    fprintf(out, "request pool: hits=%lu misses=%lu in_use=%zu high_water=%zu free=%zu "
+            "outputs_in_use=%zu free_outputs=%zu\n",
+            pool->hits, pool->misses, pool->in_use, pool->high_water, pool->free_count,
+            pool->outputs_in_use, pool->free_output_count);
+}
+
+Request* Request_new(RequestPool* pool, BufferPool* buffer_pool, ServerInfo* server_info,
+                     int client_fd, const struct sockaddr* client_addr, socklen_t client_addrlen)
+{
+    Request* request;
+    if(pool->free_list) {
+        request = pool->free_list;
+        pool->free_list = request->next_free;
+        pool->free_count--;
+        pool->hits++;
+    } else {
+        request = malloc(sizeof(Request));
+        pool->misses++;
+    }
+    if(++pool->in_use > pool->high_water)
+        pool->high_water = pool->in_use;
+
 #ifdef DEBUG
     static unsigned long request_id = 0;
     request->id = request_id++;
 #endif
+    request->next_free = NULL;
+    request->pool = pool;
+    request->output = NULL;
     request->server_info = server_info;
     request->client_fd = client_fd;
-    request->client_addr = _PEP3333_String_FromUTF8String(client_addr);
+    if(client_addrlen > sizeof(request->client_addr))
+        client_addrlen = sizeof(request->client_addr);
+    if(client_addrlen)
+        memcpy(&request->client_addr, client_addr, client_addrlen);
+    else
+        request->client_addr.ss_family = AF_UNSPEC;
+    request->client_addrlen = client_addrlen;
+    Timeouts_ENTRY_INIT(&request->timeout);
+    request->buffer_pool = buffer_pool;
+    request->read_buf = NULL;
+    request->read_class = 0;
+    request->read_start = 0;
+    request->read_len = 0;
+    request->app_pending = false;
+    request->app_next = NULL;
+#ifdef WANT_IO_URING
+    request->recv_pending = false;
+    request->closing = false;
+#endif
+    request->parser.url_buf = NULL;
+    request->parser.url_size = 0;
     llhttp_init((llhttp_t*)&request->parser, HTTP_REQUEST, &parser_settings);
     request->parser.parser.data = request;
     Request_reset(request);
@@ -36,13 +106,28 @@ void Request_reset(Request* request)
     request->parser.last_call_was_header_value = true;
     request->parser.invalid_header = false;
     request->parser.field = NULL;
+    request->parser.field_len = 0;
+    request->parser.static_header = -1;
 }
 
-void Request_free(Request* request)
+void Request_free(RequestPool* pool, Request* request)
 {
     Request_clean(request);
-    Py_DECREF(request->client_addr);
-    free(request);
+    request->read_len = 0;
+    Request_put_read_buffer(request);
+    free(request->parser.url_buf);
+    if(request->output) {
+        OutputQueue_clear(request->output);
+        Request_put_output(request);
+    }
+    pool->in_use--;
+    if(pool->free_count < REQUEST_POOL_MAX_FREE) {
+        request->next_free = pool->free_list;
+        pool->free_list = request;
+        pool->free_count++;
+    } else {
+        free(request);
+    }
 }
 
 /* Close and DECREF all the Python objects in Request.
@@ -63,20 +148,116 @@ void Request_clean(Request* request)
         Py_DECREF(request->iterable);
     }
     Py_XDECREF(request->iterator);
+    if(request->ranges != &request->single_range)
+        free(request->ranges);
+    if(request->static_file)
+        StaticFile_release(request->static_file);
+    if(request->static_scratch)
+        BufferPool_put(request->buffer_pool, 0, (char*)request->static_scratch);
+    Py_XDECREF(request->range_heads);
     Py_XDECREF(request->headers);
     Py_XDECREF(request->status);
+    if(request->body) {
+        /* The application may keep a reference to wsgi.input */
+        Input_SetSource(request->body, NULL, NULL);
+        Py_DECREF(request->body);
+    }
     Py_XDECREF(request->parser.field);
 }
 
 /* Parse stuff */
 
-void Request_parse(Request* request, const char* data, const size_t data_len)
+/* Parse `data` up to the end of the current request. Returns the number of
+ * bytes consumed; anything after that belongs to pipelined requests. */
+size_t Request_parse(Request* request, const char* data, const size_t data_len)
 {
     assert(data_len);
     llhttp_errno_t ok = llhttp_execute((llhttp_t*)&request->parser,
                                          data, data_len);
-    if(ok != HPE_OK)
+    if(ok == HPE_PAUSED) {
+        /* See on_message_complete */
+        const char* end = llhttp_get_error_pos((llhttp_t*)&request->parser);
+        llhttp_resume((llhttp_t*)&request->parser);
+        return end - data;
+    } else if(ok != HPE_OK) {
         request->state.error_code = HTTP_BAD_REQUEST;
+    }
+    return data_len;
+}
+
+/* Make sure there's a read buffer of the current size class. May only be
+ * called when there's no unparsed data in the buffer. */
+bool Request_get_read_buffer(Request* request)
+{
+    assert(request->read_len == 0);
+    if(request->read_buf && request->read_buf_class == request->read_class)
+        return true;
+    Request_put_read_buffer(request);
+    request->read_buf = BufferPool_get(request->buffer_pool, request->read_class);
+    request->read_buf_class = request->read_class;
+    return request->read_buf != NULL;
+}
+
+/* Buffers start small and follow the amount of data that arrives per read:
+ * a read that fills the buffer means there's more waiting, so the next one
+ * gets a bigger buffer; one that would have fit into the next smaller class
+ * goes back down. */
+void Request_adjust_read_class(Request* request, size_t read_bytes)
+{
+    size_t size = BUFFER_CLASS_SIZE(request->read_buf_class);
+    if(read_bytes == size && request->read_class < BUFFER_CLASSES - 1)
+        request->read_class++;
+    else if(read_bytes <= size / 4 && request->read_class > 0)
+        request->read_class--;
+}
+
+/* Give the read buffer back to the pool unless it holds unparsed data */
+void Request_put_read_buffer(Request* request)
+{
+    if(request->read_buf == NULL || request->read_len)
+        return;
+    BufferPool_put(request->buffer_pool, request->read_buf_class, request->read_buf);
+    request->read_buf = NULL;
+}
+
+/* Make sure the Request has an output queue. The pool belongs to the event
+ * loop, so app threads rely on the loop doing this before it hands them
+ * the Request; for them, the queue is always there already. */
+bool Request_get_output(Request* request)
+{
+    if(request->output)
+        return true;
+    RequestPool* pool = request->pool;
+    if(pool->free_outputs) {
+        request->output = pool->free_outputs;
+        pool->free_outputs = NEXT_FREE_OUTPUT(request->output);
+        pool->free_output_count--;
+        request->output->head = 0;
+        request->output->tail = 0;
+        request->output->size = 0;
+    } else if((request->output = OutputQueue_new()) == NULL) {
+        return false;
+    }
+    pool->outputs_in_use++;
+    return true;
+}
+
+/* Give the output queue back to the pool if everything has been sent */
+void Request_put_output(Request* request)
+{
+    OutputQueue* queue = request->output;
+    if(queue == NULL || !OutputQueue_EMPTY(queue))
+        return;
+    RequestPool* pool = request->pool;
+    pool->outputs_in_use--;
+    if(pool->free_output_count < OUTPUT_POOL_MAX_FREE) {
+        NEXT_FREE_OUTPUT(queue) = pool->free_outputs;
+        pool->free_outputs = queue;
+        pool->free_output_count++;
+    } else {
+        free(queue);
+    }
+    request->output = NULL;
 }
 
 #define REQUEST ((Request*)parser->data)
@@ -107,57 +288,271 @@ _set_or_append_header(PyObject* headers, PyObject* k, const char* val, size_t le
     Py_DECREF(py_val);
 }
 
+static void
+_set_remote_addr(llhttp_t* parser)
+{
+    Request* request = REQUEST;
+    char addr[INET6_ADDRSTRLEN];
+    int port;
+
+    if(request->client_addrlen == 0) {
+        /* Accepted without the address (io_uring's multishot accept) */
+        socklen_t addrlen = sizeof(request->client_addr);
+        if(getpeername(request->client_fd, (struct sockaddr*)&request->client_addr, &addrlen) == 0)
+            request->client_addrlen = addrlen;
+    }
+
+    switch(request->client_addr.ss_family) {
+    case AF_INET: {
+        struct sockaddr_in* sin = (struct sockaddr_in*)&request->client_addr;
+        inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr));
+        port = ntohs(sin->sin_port);
+        break;
+    }
+    case AF_INET6: {
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&request->client_addr;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, addr, sizeof(addr));
+        port = ntohs(sin6->sin6_port);
+        break;
+    }
+    default:
+        /* UNIX sockets have no meaningful peer address */
+        _set_header(_REMOTE_ADDR, _empty_string);
+        return;
+    }
+
+    _set_header_free_value(_REMOTE_ADDR, _PEP3333_String_FromUTF8String(addr));
+    _set_header_free_value(_REMOTE_PORT, _PEP3333_String_FromFormat("%d", port));
+}
+
 static int
 on_message_begin(llhttp_t* parser)
 {
     assert(PARSER->field == NULL);
-    REQUEST->headers = PyDict_New();
+    PARSER->url_len = 0;
+    REQUEST->state.message_begun = true;
+    return 0;
+}
+
+static int
+on_url(llhttp_t* parser, const char* url, size_t len) {
+    if(PARSER->url_len + len > PARSER->url_size) {
+        size_t size = PARSER->url_size ? PARSER->url_size * 2 : 256;
+        while(size < PARSER->url_len + len)
+            size *= 2;
+        char* buf = realloc(PARSER->url_buf, size);
+        if(buf == NULL)
+            return -1;
+        PARSER->url_buf = buf;
+        PARSER->url_size = size;
+    }
+    memcpy(PARSER->url_buf + PARSER->url_len, url, len);
+    PARSER->url_len += len;
     return 0;
 }
 
+/* The request line is complete (called before the first header, or at the
+ * end of the headers if there are none). Requests for static files are
+ * handled without any Python objects, others get their environ now. */
+static int
+_on_url_complete(llhttp_t* parser)
+{
+    REQUEST->state.url_complete = true;
+    if(REQUEST->server_info->static_route_count
+       && (parser->method == HTTP_GET || parser->method == HTTP_HEAD)
+       && Static_match_url(REQUEST->server_info, PARSER->url_buf, PARSER->url_len)) {
+        REQUEST->state.static_request = true;
+        REQUEST->static_scratch = (StaticScratch*)BufferPool_get(REQUEST->buffer_pool, 0);
+        return REQUEST->static_scratch == NULL;
+    }
+    /* Static_request_line() would have said so if there's no GIL */
+    assert(PyGILState_Check());
+    REQUEST->headers = PyDict_New();
+    return REQUEST->headers == NULL;
+}
+
 static int
-on_url(llhttp_t* parser, const char* url, size_t len) { 
+_parse_url(llhttp_t* parser) {
     struct http_parser_url u;
+    const char* url = PARSER->url_buf;
+    size_t len = PARSER->url_len;
 
     int result = http_parser_parse_url(url, len, 0, &u);
     if (result) {
-        fprintf(stderr, "\n\n*** failed to parse URL %s ***\n\n", url);
+        DBG_REQ(REQUEST, "Failed to parse URL %.*s", (int)len, url);
         return -1;
     }
     if ((u.field_set & (1 << UF_PATH))) {
         const char * data1 = url + u.field_data[UF_PATH].off;
-        //printf("path: %s len: %hu\n", data1, u.field_data[UF_PATH].len);
         _set_or_append_header(REQUEST->headers, _PATH_INFO, data1, u.field_data[UF_PATH].len);  
     }
     else {
-        fprintf(stderr, "\n\n*** failed to parser PATH in url %s ***\n\n", url);
+        DBG_REQ(REQUEST, "No path in URL %.*s", (int)len, url);
         return -1;
     }
 
     if ((u.field_set & (1 << UF_QUERY))) {
         const char * data2 = url + u.field_data[UF_QUERY].off;
-        //printf("query: %s len: %hu\n", data2, u.field_data[UF_QUERY].len);
         _set_or_append_header(REQUEST->headers, _QUERY_STRING, data2, u.field_data[UF_QUERY].len);
     }
 
     return 0;
 }
 
-static int
-on_status(llhttp_t* parser, const char* status, size_t len) {
-    printf("status: %s len: %zu\n", status, len);
+/* Well-known request headers, mapped straight to pre-built (interned)
+ * environ keys so that they don't cost any string construction. Names are
+ * stored in their CGI form, i.e. after `cgi_header_name`. */
+static struct {
+    const char* name;
+    size_t len;
+    PyObject* key;
+} known_headers[] = {
+#define H(name) { name, sizeof(name) - 1, NULL }
+    H("HOST"), H("USER_AGENT"), H("ACCEPT"), H("ACCEPT_ENCODING"),
+    H("ACCEPT_LANGUAGE"), H("ACCEPT_CHARSET"), H("CONNECTION"), H("COOKIE"),
+    H("CONTENT_TYPE"), H("CONTENT_LENGTH"), H("CACHE_CONTROL"), H("PRAGMA"),
+    H("REFERER"), H("ORIGIN"), H("AUTHORIZATION"), H("IF_MODIFIED_SINCE"),
+    H("IF_NONE_MATCH"), H("IF_RANGE"), H("RANGE"), H("EXPECT"),
+    H("TRANSFER_ENCODING"), H("UPGRADE"), H("UPGRADE_INSECURE_REQUESTS"),
+    H("X_FORWARDED_FOR"), H("X_FORWARDED_PROTO"), H("X_FORWARDED_HOST"),
+    H("X_REAL_IP"), H("X_REQUESTED_WITH"), H("DNT"),
+    H("SEC_FETCH_DEST"), H("SEC_FETCH_MODE"), H("SEC_FETCH_SITE"),
+    H("SEC_FETCH_USER"),
+#undef H
+};
 
-    return 0;
+#define N_KNOWN_HEADERS (sizeof(known_headers) / sizeof(known_headers[0]))
+
+static void
+_init_known_headers(void)
+{
+    char buf[HEADER_FIELD_BUFFER_SIZE];
+    for(size_t i = 0; i < N_KNOWN_HEADERS; ++i) {
+        if(known_headers[i].key != NULL)
+            continue;
+        snprintf(buf, sizeof(buf), "HTTP_%s", known_headers[i].name);
+        known_headers[i].key = _PEP3333_String_InternFromString(buf);
+    }
+}
+
+/* Return a new reference to the environ key for the header name in `buf`
+ * ("HTTP_" followed by the CGI-transformed name). */
+static PyObject*
+_header_key(const char* buf, size_t len)
+{
+    const char* name = buf + strlen("HTTP_");
+    size_t name_len = len - strlen("HTTP_");
+
+    for(size_t i = 0; i < N_KNOWN_HEADERS; ++i) {
+        if(known_headers[i].len == name_len &&
+           known_headers[i].name[0] == name[0] &&
+           !memcmp(known_headers[i].name, name, name_len)) {
+            Py_INCREF(known_headers[i].key);
+            return known_headers[i].key;
+        }
+    }
+    return _PEP3333_String_FromLatin1StringAndSize(buf, len);
+}
+
+/* Header name -> CGI form: uppercase, '-' -> '_'. Returns false for names
+ * containing '_', which are rejected (CVE-2015-0219). */
+static bool
+cgi_header_name_scalar(char* dst, const char* src, size_t len)
+{
+    for(size_t i = 0; i < len; i++) {
+        char c = src[i];
+        if(c == '_') {
+            return false;
+        } else if (c == '-') {
+            dst[i] = '_';
+        } else if(c >= 'a' && c <= 'z') {
+            dst[i] = c - ('a' - 'A');
+        } else {
+            dst[i] = c;
+        }
+    }
+    return true;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Same transform, 16 bytes at a time. `len` must be >= 16; a partial last
+ * block is done by redoing the last 16 bytes, overlapping the previous
+ * block. Bytes >= 0x80 are negative in the signed compares and thus never
+ * treated as lowercase. SSE2 is part of x86-64, so there's no runtime
+ * dispatch (an AVX2 variant measured slower than this, and even slower
+ * than the scalar loop, on 20-40 byte names: its 16-byte remainder
+ * mixed VEX and legacy SSE code). */
+static bool
+cgi_header_name_sse2(char* dst, const char* src, size_t len)
+{
+    const __m128i underscore = _mm_set1_epi8('_');
+    const __m128i dash = _mm_set1_epi8('-');
+    const __m128i before_a = _mm_set1_epi8('a' - 1);
+    const __m128i after_z = _mm_set1_epi8('z' + 1);
+    const __m128i case_bit = _mm_set1_epi8('a' - 'A');
+    size_t i = 0;
+
+    for(;;) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, underscore)))
+            return false;
+        __m128i is_dash = _mm_cmpeq_epi8(v, dash);
+        __m128i is_lower = _mm_and_si128(_mm_cmpgt_epi8(v, before_a),
+                                         _mm_cmpgt_epi8(after_z, v));
+        v = _mm_sub_epi8(v, _mm_and_si128(is_lower, case_bit));
+        v = _mm_or_si128(_mm_andnot_si128(is_dash, v),
+                         _mm_and_si128(is_dash, underscore));
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+        if(i + 16 == len)
+            return true;
+        i = i + 32 <= len ? i + 16 : len - 16;
+    }
+}
+#endif
+
+static inline bool
+cgi_header_name(char* dst, const char* src, size_t len)
+{
+#ifdef __SSE2__
+    /* Most header names are short; only long ones (cookies, tracing,
+     * Sec-* headers...) fill a vector. */
+    if(len >= 16)
+        return cgi_header_name_sse2(dst, src, len);
+#endif
+    return cgi_header_name_scalar(dst, src, len);
+}
+
+/* Static requests: index of the header in `field_buf` in static_scratch */
+static int
+_static_header(const char* buf, size_t len)
+{
+    static const char* names[STATIC_HEADERS] = {
+        [STATIC_IF_NONE_MATCH] = "HTTP_IF_NONE_MATCH",
+        [STATIC_IF_MODIFIED_SINCE] = "HTTP_IF_MODIFIED_SINCE",
+        [STATIC_RANGE] = "HTTP_RANGE",
+        [STATIC_IF_RANGE] = "HTTP_IF_RANGE",
+        [STATIC_ACCEPT_ENCODING] = "HTTP_ACCEPT_ENCODING",
+    };
+    for(int i = 0; i < STATIC_HEADERS; ++i) {
+        if(strlen(names[i]) == len && !memcmp(names[i], buf, len))
+            return i;
+    }
+    return -1;
 }
 
 static int
 on_header_field(llhttp_t* parser, const char* field, size_t len)
 {
+    if(!REQUEST->state.url_complete && _on_url_complete(parser))
+        return 1;
+
     if(PARSER->last_call_was_header_value) {
         /* We are starting a new header */
-        Py_XDECREF(PARSER->field);
-        Py_INCREF(_HTTP_);
-        PARSER->field = _HTTP_;
+        Py_CLEAR(PARSER->field);
+        memcpy(PARSER->field_buf, "HTTP_", strlen("HTTP_"));
+        PARSER->field_len = strlen("HTTP_");
         PARSER->last_call_was_header_value = false;
         PARSER->invalid_header = false;
     }
@@ -167,20 +562,36 @@ on_header_field(llhttp_t* parser, const char* field, size_t len)
         return 0;
     }
 
-    char field_processed[len];
-    for(size_t i = 0; i < len; i++) {
-        char c = field[i];
-        if(c == '_') {
-            // CVE-2015-0219
+    if(PARSER->field == NULL && PARSER->field_len + len <= HEADER_FIELD_BUFFER_SIZE) {
+        /* Common case: collect the name (possibly split across several
+         * reads) in the parser's buffer, the key is looked up once the
+         * value starts. */
+        if(!cgi_header_name(PARSER->field_buf + PARSER->field_len, field, len)) {
             PARSER->invalid_header = true;
             return 0;
-        } else if (c == '-') {
-            field_processed[i] = '_';
-        } else if(c >= 'a' && c <= 'z') {
-            field_processed[i] = c - ('a' - 'A');
-        } else {
-            field_processed[i] = c;
         }
+        PARSER->field_len += len;
+        return 0;
+    }
+
+    if(REQUEST->state.static_request) {
+        /* None of the headers we're interested in */
+        PARSER->invalid_header = true;
+        return 0;
+    }
+
+    /* Overlong header name: continue as a Python string */
+    char field_processed[len];
+    if(!cgi_header_name(field_processed, field, len)) {
+        PARSER->invalid_header = true;
+        return 0;
+    }
+
+    if(PARSER->field == NULL) {
+        PARSER->field = _PEP3333_String_FromLatin1StringAndSize(PARSER->field_buf,
+                                                                PARSER->field_len);
+        if(PARSER->field == NULL)
+            return 1;
     }
 
     /* Append field name to the part we got from previous call */
@@ -193,52 +604,60 @@ on_header_field(llhttp_t* parser, const char* field, size_t len)
     return PARSER->field == NULL;
 }
 
-static int
-on_header_value(llhttp_t* parser, const char* value, size_t len)
+/* Static requests: collect the values of the headers in static_scratch */
+static void
+_static_header_value(Request* request, const char* value, size_t len, bool first)
 {
-    PARSER->last_call_was_header_value = true;
-    if(!PARSER->invalid_header) {
-        /* Set header, or append data to header if this is not the first call */
-        _set_or_append_header(REQUEST->headers, PARSER->field, value, len);
+    bj_parser* parser = &request->parser;
+    if(first) {
+        parser->static_header = parser->invalid_header
+                                ? -1 : _static_header(parser->field_buf, parser->field_len);
+        if(parser->static_header != -1 && request->static_value_lens[parser->static_header]) {
+            /* Repeated */
+            request->static_value_lens[parser->static_header] = STATIC_VALUE_UNUSABLE;
+            parser->static_header = -1;
+        }
     }
-    return 0;
-}
-
-static int
-on_header_complete(llhttp_t* parser) {
+    if(parser->static_header == -1)
+        return;
 
-    printf("header complete\n");
-    printf("header size: %d\n", PyDict_GET_SIZE(REQUEST->headers));
-    return 0;
+    unsigned char* value_len = &request->static_value_lens[parser->static_header];
+    if(*value_len + len > STATIC_VALUE_SIZE) {
+        *value_len = STATIC_VALUE_UNUSABLE;
+        parser->static_header = -1;
+        return;
+    }
+    memcpy(request->static_scratch->values[parser->static_header] + *value_len, value, len);
+    *value_len += len;
 }
 
 static int
-on_body(llhttp_t* parser, const char* data, const size_t len)
+on_header_value(llhttp_t* parser, const char* value, size_t len)
 {
-    PyObject* body;
+    if(REQUEST->state.static_request) {
+        _static_header_value(REQUEST, value, len, !PARSER->last_call_was_header_value);
+        PARSER->last_call_was_header_value = true;
+        return 0;
+    }
 
-    body = PyDict_GetItem(REQUEST->headers, _wsgi_input);
-    if (body == NULL) {
-        /*if(!parser->content_length) {
-            REQUEST->state.error_code = HTTP_LENGTH_REQUIRED;
+    if(!PARSER->last_call_was_header_value && !PARSER->invalid_header
+       && PARSER->field == NULL) {
+        /* First value fragment: the header name is complete now */
+        PARSER->field = _header_key(PARSER->field_buf, PARSER->field_len);
+        if(PARSER->field == NULL)
             return 1;
-        }*/
-        body = PyObject_CallMethodObjArgs(IO_module, _BytesIO, NULL);
-        if (body == NULL) {
-            return 1;
-        }
-        _set_header_free_value(_wsgi_input, body);
     }
-    PyObject* temp_data = _PEP3333_Bytes_FromStringAndSize(data, len);
-    PyObject* tmp = PyObject_CallMethodObjArgs(body, _write, temp_data, NULL);
-    Py_DECREF(tmp); /* Never throw away return objects from py-api */
-    Py_DECREF(temp_data);
-
+    PARSER->last_call_was_header_value = true;
+    if(!PARSER->invalid_header) {
+        /* Set header, or append data to header if this is not the first call */
+        _set_or_append_header(REQUEST->headers, PARSER->field, value, len);
+    }
     return 0;
 }
 
+/* Complete the WSGI environ once all request headers are known */
 static int
-on_message_complete(llhttp_t* parser)
+_finish_environ(llhttp_t* parser)
 {
     /* HTTP_CONTENT_{LENGTH,TYPE} -> CONTENT_{LENGTH,TYPE} */
     PyDict_ReplaceKey(REQUEST->headers, _HTTP_CONTENT_LENGTH, _CONTENT_LENGTH);
@@ -257,26 +676,183 @@ on_message_complete(llhttp_t* parser)
                               );
     }
 
-    /* REMOTE_ADDR */
-    _set_header(_REMOTE_ADDR, REQUEST->client_addr);
+    /* REMOTE_ADDR, REMOTE_PORT */
+    _set_remote_addr(parser);
 
-    PyObject* body = PyDict_GetItem(REQUEST->headers, _wsgi_input);
-    if(body) {
-        /* first do a seek(0) and then read() returns all data */
-        PyObject* buf = PyObject_CallMethodObjArgs(body, _seek, _FromLong(0), NULL);
-        Py_DECREF(buf); /* Discard the return value */
-    } else {
-        /* Request has no body */
-        body = PyObject_CallMethodObjArgs(IO_module, _BytesIO, NULL);
-        _set_header_free_value(_wsgi_input, body);
+    if(REQUEST->body == NULL) {
+        /* Request has no body (yet) */
+        REQUEST->body = Input_New(REQUEST->server_info->input_spill_threshold);
+        if(REQUEST->body == NULL)
+            return -1;
     }
+    _set_header(_wsgi_input, REQUEST->body);
 
-    PyDict_Update(REQUEST->headers, wsgi_base_dict);
+    PyDict_Update(REQUEST->headers, REQUEST->server_info->wsgi_base_dict);
+    return 0;
+}
 
-    REQUEST->state.parse_finished = true;
+/* Send "100 Continue" from an app thread. It goes through the output queue
+ * like any response data; parse_requests only dispatches early once the
+ * responses to earlier pipelined requests are out, so the queue is empty. */
+static int
+_send_continue(Request* request)
+{
+    static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    assert(request->output);
+    OutputQueue_push(request->output, continue_line, sizeof(continue_line) - 1, NULL);
+
+    while(!OutputQueue_EMPTY(request->output)) {
+        if(OutputQueue_send(request->output, request->client_fd) != -1)
+            continue;
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        struct pollfd pfd = { request->client_fd, POLLOUT, 0 };
+        int ready;
+        Py_BEGIN_ALLOW_THREADS
+        ready = poll(&pfd, 1, request->server_info->write_timeout
+                              ? request->server_info->write_timeout * 1000 : -1);
+        Py_END_ALLOW_THREADS
+        if(ready == 0) {
+            PyErr_SetString(PyExc_IOError, "timed out sending 100 Continue");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* wsgi.input source in early dispatch mode: wait for and parse more data
+ * from the client. Early dispatch is only done with app threads, so the
+ * application call blocks its app thread here, not the event loop. Response
+ * iterators that go on in the event loop get a buffered body, see
+ * wsgi_call_application(). */
+static int
+_read_body_from_client(void* arg)
+{
+    Request* request = arg;
+    ssize_t read_bytes;
+    int ready = 1;
+
+    assert(request->app_pending);
+    if(request->state.expect_continue) {
+        /* The client waits for our go before sending the body */
+        request->state.expect_continue = false;
+        if(_send_continue(request) == -1)
+            return -1;
+    }
+
+    /* The application call consumed all input so far. The BufferPool
+     * belongs to the event loop, so stick to the buffer the request came
+     * in with. */
+    assert(request->read_len == 0);
+    assert(request->read_buf);
+    char* buf = request->read_buf;
+    size_t size = BUFFER_CLASS_SIZE(request->read_buf_class);
+
+    Py_BEGIN_ALLOW_THREADS
+    while(true) {
+        read_bytes = read(request->client_fd, buf, size);
+        if(read_bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            break;
+        struct pollfd pfd = { request->client_fd, POLLIN, 0 };
+        ready = poll(&pfd, 1, request->server_info->body_timeout
+                              ? request->server_info->body_timeout * 1000 : -1);
+        if(ready == 0)
+            break;
+    }
+    Py_END_ALLOW_THREADS
+
+    if(ready == 0) {
+        PyErr_SetString(PyExc_IOError, "timed out reading request body");
+        return -1;
+    }
+    if(read_bytes == 0) {
+        PyErr_SetString(PyExc_IOError, "client disconnected while sending request body");
+        return -1;
+    }
+    if(read_bytes < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+
+    Request_adjust_read_class(request, (size_t)read_bytes);
+    size_t parsed = Request_parse(request, buf, (size_t)read_bytes);
+    if(request->state.error_code) {
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_IOError, "malformed request body");
+        return -1;
+    }
+    /* Keep the start of pipelined requests until the current one is done */
+    request->read_start = parsed;
+    request->read_len = read_bytes - parsed;
+    return 0;
+}
+
+static int
+on_header_complete(llhttp_t* parser) {
+
+    if(!REQUEST->state.url_complete && _on_url_complete(parser))
+        return -1;
+    REQUEST->state.headers_parsed = true;
+    if(REQUEST->state.static_request) {
+        DBG_REQ(REQUEST, "Headers complete: static request");
+        return 0;
+    }
+
+    DBG_REQ(REQUEST, "Headers complete: %zd headers", PyDict_GET_SIZE(REQUEST->headers));
+
+    if(_parse_url(parser) == -1)
+        return -1;
+
+    if(REQUEST->server_info->early_dispatch) {
+        /* Call the application right away; the body is streamed into
+         * wsgi.input while it is being read. */
+        PyObject* expect = PyDict_GetItemString(REQUEST->headers, "HTTP_EXPECT");
+        if(_finish_environ(parser) == -1)
+            return -1;
+        if(expect && PyUnicode_Check(expect)
+           && PyUnicode_CompareWithASCIIString(expect, "100-continue") == 0)
+            REQUEST->state.expect_continue = true;
+        Input_SetSource(REQUEST->body, _read_body_from_client, REQUEST);
+        REQUEST->state.headers_finished = true;
+    }
     return 0;
 }
 
+static int
+on_body(llhttp_t* parser, const char* data, const size_t len)
+{
+    if(REQUEST->state.static_request)
+        /* Not for us */
+        return 0;
+    if(REQUEST->body == NULL) {
+        REQUEST->body = Input_New(REQUEST->server_info->input_spill_threshold);
+        if(REQUEST->body == NULL)
+            return 1;
+    }
+    return Input_Write(REQUEST->body, data, len) == -1;
+}
+
+static int
+on_message_complete(llhttp_t* parser)
+{
+    if(!REQUEST->state.static_request) {
+        if(!REQUEST->state.headers_finished) {
+            if(_finish_environ(parser) == -1)
+                return -1;
+        }
+        Input_Finish(REQUEST->body);
+    }
+
+    REQUEST->state.parse_finished = true;
+
+    /* Stop here so that a pipelined request isn't parsed into this Request
+     * before it's been served. This also leaves the parser's flags intact
+     * for llhttp_should_keep_alive() until parsing continues. */
+    return HPE_PAUSED;
+}
+
 static inline void
 PyDict_ReplaceKey(PyObject* dict, PyObject* old_key, PyObject* new_key)
 {
@@ -292,20 +868,19 @@ PyDict_ReplaceKey(PyObject* dict, PyObject* old_key, PyObject* new_key)
 
 static llhttp_settings_t
 parser_settings = {
-    on_message_begin, on_url, on_status, on_header_field,
+    on_message_begin, on_url, NULL /* on_status */, on_header_field,
     on_header_value, on_header_complete, on_body, on_message_complete, NULL, NULL
 };
 
 void _initialize_request_module(ServerInfo* server_info)
 {
-    IO_module = PyImport_ImportModule("io");
-    if (IO_module == NULL) {
-        /* PyImport_ImportModule should have exception set already */
-        return;
-    }
+    _init_known_headers();
 
-    if(wsgi_base_dict == NULL) {
-        wsgi_base_dict = PyDict_New();
+    /* Every event loop gets its own copy, so that threads don't contend
+     * for the dict when copying it into the environ of each request. */
+    if(server_info->wsgi_base_dict == NULL) {
+        PyObject* wsgi_base_dict = PyDict_New();
+        server_info->wsgi_base_dict = wsgi_base_dict;
 
         /* dct['wsgi.file_wrapper'] = FileWrapper */
         PyDict_SetItemString(
@@ -344,13 +919,13 @@ void _initialize_request_module(ServerInfo* server_info)
             PySys_GetObject("stderr")
         );
 
-        /* dct['wsgi.multithread'] = False
-         * (Tell the application that it is being run
-         *  in a single-threaded environment.) */
+        /* dct['wsgi.multithread'] = threads > 1 or app_threads > 0
+         * (Tell the application whether several event loop or app
+         *  threads may call it at the same time.) */
         PyDict_SetItemString(
             wsgi_base_dict,
             "wsgi.multithread",
-            Py_False
+            server_info->threads > 1 || server_info->app_threads > 0 ? Py_True : Py_False
         );
 
         /* dct['wsgi.multiprocess'] = True
@@ -362,6 +937,15 @@ void _initialize_request_module(ServerInfo* server_info)
             Py_True
         );
 
+        /* dct['wsgi.input_terminated'] = True
+         * (wsgi.input returns EOF at the end of the body, so it can be read
+         *  without relying on CONTENT_LENGTH, e.g. for chunked uploads.) */
+        PyDict_SetItemString(
+            wsgi_base_dict,
+            "wsgi.input_terminated",
+            Py_True
+        );
+
         /* dct['wsgi.run_once'] = False
          * (bjoern is no CGI gateway) */
         PyDict_SetItemString(
@@ -379,7 +963,7 @@ void _initialize_request_module(ServerInfo* server_info)
             if (server_info->port == Py_None) {
                 PyDict_SetItemString(wsgi_base_dict, "SERVER_PORT", _PEP3333_String_FromFormat(""));
             } else {
-                PyDict_SetItemString(wsgi_base_dict, "SERVER_PORT", _PEP3333_String_FromFormat("%i", server_info->port));
+                PyDict_SetItemString(wsgi_base_dict, "SERVER_PORT", PyObject_Str(server_info->port));
             }
         } else {
             /* SERVER_NAME is required, but not usefull with UNIX type sockets */
@@ -2,10 +2,17 @@
 #define __request_h__
 
 #include <ev.h>
+#include <sys/socket.h>
 #include "llhttp.h"
 #include "url_parser.h"
 #include "common.h"
 #include "server.h"
+#include "trace.h"
+#include "output.h"
+#include "buffer.h"
+#include "timeout.h"
+#include "range.h"
+#include "static.h"
 
 void _initialize_request_module(ServerInfo* server_info);
 
@@ -17,43 +24,144 @@ typedef struct {
     unsigned keep_alive : 1;
     unsigned response_length_unknown : 1;
     unsigned chunked_response : 1;
+    unsigned headers_finished : 1; /* early dispatch: environ is ready */
+    unsigned body_streaming : 1;   /* early dispatch: app called, wsgi.input reads the rest */
+    unsigned headers_parsed : 1;
+    unsigned expect_continue : 1;
+    unsigned accept_ranges : 1;    /* file response; add "Accept-Ranges: bytes" */
+    unsigned vary_encoding : 1;    /* file response; add "Vary: Accept-Encoding" */
+    unsigned message_begun : 1;
+    unsigned url_complete : 1;
+    unsigned static_request : 1;   /* served from a static route, see static.c */
 } request_state;
 
+/* Header names up to this length (including the "HTTP_" prefix) are
+ * collected in `field_buf` and only turned into a Python key once complete. */
+#define HEADER_FIELD_BUFFER_SIZE 128
+
 typedef struct {
     llhttp_t parser;
+    /* The URL may arrive in several pieces; it's collected here and
+     * parsed once the headers are complete. */
+    char* url_buf;
+    size_t url_len;
+    size_t url_size;
     PyObject* field;
+    char field_buf[HEADER_FIELD_BUFFER_SIZE];
+    size_t field_len;
     int last_call_was_header_value;
     int invalid_header;
+    int static_header; /* static requests: STATIC_* index of the current header, or -1 */
 } bj_parser;
 
-typedef struct {
+typedef struct _RequestPool RequestPool;
+
+typedef struct _Request {
 #ifdef DEBUG
     unsigned long id;
 #endif
+    struct _Request* next_free; /* RequestPool freelist link */
     bj_parser parser;
     ev_io ev_watcher;
+    timeout_entry timeout;
 
     ServerInfo* server_info;
     int client_fd;
-    PyObject* client_addr;
-
+    /* Raw peer address; only formatted into REMOTE_ADDR/REMOTE_PORT
+     * once a request has actually been parsed. Looked up then if it wasn't
+     * known at accept time (client_addrlen 0). */
+    struct sockaddr_storage client_addr;
+    socklen_t client_addrlen;
+    /* Read buffer from the loop's BufferPool. It's only held while a request
+     * is being handled or there's unparsed data in it (the start of pipelined
+     * requests), so idle connections don't take up any buffer memory. */
+    BufferPool* buffer_pool;
+    char* read_buf;
+    int read_buf_class;
+    int read_class;    /* size class for the next buffer */
+    size_t read_start; /* unparsed data is read_buf[read_start:read_start+read_len] */
+    size_t read_len;
+    /* Response data not yet written. May hold the responses to several
+     * pipelined requests. Like the read buffer, it's only held while there's
+     * a response to send and goes back to the RequestPool once drained. */
+    RequestPool* pool;
+    OutputQueue* output;
+    /* Set while an app thread calls the application for the current request
+     * (see ThreadPool); the event loop keeps its hands off the Request,
+     * including the read buffer, until the call is done. */
+    bool app_pending;
+    bool app_failed; /* not even an error response could be queued */
+    struct ev_loop* app_loop;
+    struct _Request* app_next; /* ThreadPool queue link */
+#ifdef WANT_IO_URING
+    /* With io_uring there's a recv in flight for the connection while it
+     * waits for data; a connection closed meanwhile is only freed when the
+     * recv completes. */
+    bool recv_pending;
+    bool closing;
+#endif
     request_state state;
 
     PyObject* status;
     PyObject* headers;
-    PyObject* current_chunk;
-    Py_ssize_t current_chunk_p;
+    off_t file_offset; /* sendfile() position */
+    /* Range responses send these parts of the file; with several of them
+     * (multipart/byteranges) each is preceded by its part header from
+     * `range_heads`, and an empty last range carries the closing boundary. */
+    byte_range* ranges;
+    PyObject* range_heads;
+    int range_count;
+    int range_index;
+    byte_range single_range; /* `ranges` if there's only one */
+    unsigned char static_value_lens[STATIC_HEADERS];
+    StaticScratch* static_scratch;
+    StaticFile* static_file;
     PyObject* iterable;
     PyObject* iterator;
+    PyObject* body; /* wsgi.input */
+#ifdef WANT_TRACING
+    uint64_t write_started;
+    uint64_t app_started; /* pooled app calls: picked up by an app thread */
+#endif
 } Request;
 
 #define REQUEST_FROM_WATCHER(watcher) \
   (Request*)((size_t)watcher - (size_t)(&(((Request*)NULL)->ev_watcher)));
+#define REQUEST_FROM_TIMEOUT(entry) \
+  (Request*)((size_t)entry - (size_t)(&(((Request*)NULL)->timeout)));
+
+/* Per-loop cache of Request structs, so that connection floods don't
+ * malloc()/free() one Request per connection. */
+#define REQUEST_POOL_MAX_FREE 1024
+/* Likewise for output queues, which are chained through their first bytes */
+#define OUTPUT_POOL_MAX_FREE 256
+
+struct _RequestPool {
+    Request* free_list;
+    size_t free_count;
+    size_t in_use;
+    size_t high_water;
+    unsigned long hits;
+    unsigned long misses;
+    OutputQueue* free_outputs;
+    size_t free_output_count;
+    size_t outputs_in_use;
+};
+
+void RequestPool_init(RequestPool*);
+void RequestPool_destroy(RequestPool*);
+void RequestPool_print_stats(RequestPool*, FILE*);
 
-Request* Request_new(ServerInfo*, int client_fd, const char* client_addr);
-void Request_parse(Request*, const char*, const size_t);
+Request* Request_new(RequestPool*, BufferPool*, ServerInfo*, int client_fd,
+                     const struct sockaddr* client_addr, socklen_t client_addrlen);
+size_t Request_parse(Request*, const char*, const size_t);
+bool Request_get_read_buffer(Request*);
+void Request_adjust_read_class(Request*, size_t read_bytes);
+void Request_put_read_buffer(Request*);
+bool Request_get_output(Request*);
+void Request_put_output(Request*);
 void Request_reset(Request*);
 void Request_clean(Request*);
-void Request_free(Request*);
+void Request_free(RequestPool*, Request*);
 
 #endif
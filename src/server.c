@@ -1,5 +1,10 @@
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <ev.h>
 
 #if defined(__FreeBSD__) || defined(__DragonFly__)
@@ -17,10 +22,12 @@
 #include "common.h"
 #include "wsgi.h"
 #include "server.h"
+#include "threadpool.h"
+#include "uring.h"
+#include "static.h"
 
 #include "py2py3.h"
 
-#define READ_BUFFER_SIZE 64*1024
 #define Py_XCLEAR(obj) do { if(obj) { Py_DECREF(obj); obj = NULL; } } while(0)
 #define GIL_LOCK(n) PyGILState_STATE _gilstate_##n = PyGILState_Ensure()
 #define GIL_UNLOCK(n) PyGILState_Release(_gilstate_##n)
@@ -32,53 +39,273 @@ static const char* http_error_messages[4] = {
     "HTTP/1.1 500 Internal Server Error\r\n\r\n"
 };
 
+/* Sent to connections turned away because we're out of file descriptors */
+static const char http_busy_message[] =
+    "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+
+/* Accepting is retried after this many seconds if we're out of file
+ * descriptors and no connection of ours closes in the meantime */
+#define ACCEPT_RETRY_INTERVAL 1.
+
 enum _rw_state {
     not_yet_done = 1,
     done,
     aborted,
+    offloaded, /* parse_requests(): the app is to be called by an app thread */
 };
 typedef enum _rw_state read_state;
 typedef enum _rw_state write_state;
 
 typedef struct {
     ServerInfo* server_info;
+    struct ev_loop* loop;
+    int index;      /* 0 runs in the main thread */
+    pthread_t thread;
+    ev_async shutdown_watcher;
+    ev_async stats_watcher;
     ev_io accept_watcher;
+    ev_timer accept_retry_watcher;
+    bool accept_paused;
+    int reserved_fd;                /* spare fd for turning connections away */
+    unsigned long deferred_accepts; /* accept watcher stopped at the connection limit */
+    unsigned long rejected_accepts; /* connections turned away, out of fds */
+    RequestPool request_pool;
+    BufferPool buffer_pool;
+    Timeouts timeouts;
+    /* App calls done by the ThreadPool come back through this */
+    ev_async app_done_watcher;
+    pthread_mutex_t app_done_lock;
+    Request* app_done;               /* linked through app_next */
+    unsigned long pooled_calls;  /* app calls handed to the ThreadPool */
+    unsigned long pending_calls; /* ... and not done yet */
+#ifdef WANT_IO_URING
+    /* With --io-uring, connections are accepted and read through this ring
+     * instead of libev's watchers; NULL if not in use */
+    Uring* uring;
+    ev_io uring_watcher;       /* completions are waiting */
+    ev_prepare uring_prepare;  /* submits the queued SQEs before the loop blocks */
+    bool accept_armed;         /* multishot accept in flight */
+    unsigned long accept_gen;
+#endif
+    unsigned long direct_writes;   /* responses sent completely from ev_io_on_read */
+    unsigned long deferred_writes; /* responses that needed an EV_WRITE watcher */
+    unsigned long sendfile_calls;
+    unsigned long long sendfile_bytes;
+    StaticCache static_cache;
+#ifdef WANT_TRACING
+    trace_stats trace;
+#endif
 } ThreadInfo;
 
+#define THREAD_INFO(loop) ((ThreadInfo*)ev_userdata(loop))
+
+/* All event loops of the process */
+static ThreadInfo* thread_infos;
+static int thread_count;
+
+/* Shared by all loops; not started if app_threads is 0 */
+static ThreadPool app_pool;
+
+/* The current request has been answered (or its response is being
+ * produced); otherwise it's still being received */
+#define REQUEST_DISPATCHED(request) \
+  ((request)->state.parse_finished || (request)->state.body_streaming \
+   || (request)->state.error_code)
+
+/* Early dispatch: the headers are complete, but the application can't be
+ * called before the responses to earlier pipelined requests are sent */
+#define EARLY_DISPATCH_PENDING(request) \
+  ((request)->state.headers_finished && !(request)->state.parse_finished \
+   && !(request)->state.body_streaming && !(request)->state.error_code)
+
+#define SENDFILE_RESPONSE(request) \
+  ((request)->static_file \
+   || ((request)->iterable && FileWrapper_CheckExact((request)->iterable) \
+       && FileWrapper_GetFd((request)->iterable) != -1))
+
 typedef void ev_io_callback(struct ev_loop*, ev_io*, const int);
+typedef void ev_signal_callback(struct ev_loop*, ev_signal*, const int);
+typedef void ev_timer_callback(struct ev_loop*, ev_timer*, const int);
+typedef void ev_async_callback(struct ev_loop*, ev_async*, const int);
 
 #if WANT_SIGINT_HANDLING
-typedef void ev_signal_callback(struct ev_loop*, ev_signal*, const int);
 static ev_signal_callback ev_signal_on_sigint;
 #endif
+static ev_signal_callback ev_signal_on_sigusr1;
+static ev_async_callback ev_async_on_shutdown;
+static ev_async_callback ev_async_on_stats;
+static ev_async_callback ev_async_on_app_done;
+static void stop_accepting(struct ev_loop*);
+static void print_stats(struct ev_loop*);
+
+static ev_timer_callback ev_timer_on_timeout;
+static ev_timer_callback ev_timer_on_accept_retry;
 
 #if WANT_SIGINT_HANDLING
-typedef void ev_timer_callback(struct ev_loop*, ev_timer*, const int);
 static ev_timer_callback ev_timer_ontick;
 ev_timer timeout_watcher;
 #endif
 
 static ev_io_callback ev_io_on_request;
+static void new_connection(struct ev_loop*, int, struct sockaddr*, socklen_t);
+static void accept_watcher_start(struct ev_loop*);
+static void accept_watcher_stop(struct ev_loop*);
+static void pause_accepting(struct ev_loop*, bool);
+static void resume_accepting(struct ev_loop*);
+static bool reject_connection(ThreadInfo*, int);
 static ev_io_callback ev_io_on_read;
+static void handle_read(struct ev_loop*, Request*, ssize_t);
 static ev_io_callback ev_io_on_write;
+static bool serve_input(struct ev_loop*, Request*);
+static read_state serve_static_input(struct ev_loop*, Request*);
+static bool without_python(Request*);
+static bool handle_input(struct ev_loop*, Request*);
+static read_state parse_requests(struct ev_loop*, Request*, const char**, size_t*);
+static bool call_application(Request*);
+static void submit_app_call(struct ev_loop*, Request*);
+static void run_app_call(Request*);
+static bool send_response(struct ev_loop*, Request*);
+static void wait_for_io(struct ev_loop*, Request*);
+static bool response_queued(Request*);
+static write_state write_response(struct ev_loop*, Request*);
+static bool finish_response(struct ev_loop*, Request*, write_state);
+static void update_timeout(struct ev_loop*, Request*);
+static void switch_watcher(struct ev_loop*, Request*, ev_io_callback*, int);
+static void start_watcher(struct ev_loop*, Request*);
 static write_state on_write_sendfile(struct ev_loop*, Request*);
 static write_state on_write_chunk(struct ev_loop*, Request*);
-static bool do_send_chunk(Request*);
-static bool do_sendfile(Request*);
+static bool queue_error_response(Request*, int);
+static bool do_send_queue(Request*);
+static bool do_sendfile(struct ev_loop*, Request*);
+static bool next_range(Request*);
 static bool handle_nonzero_errno(Request*);
 static void close_connection(struct ev_loop*, Request*);
+static void release_request(struct ev_loop*, Request*);
+
+#ifdef WANT_IO_URING
+static void uring_start(ThreadInfo*);
+static ev_io_callback ev_io_on_uring;
+static void ev_prepare_on_uring(struct ev_loop*, ev_prepare*, const int);
+static void uring_accept(struct ev_loop*);
+static void uring_cancel_accept(struct ev_loop*);
+static void uring_on_accept(struct ev_loop*, uint64_t, int, unsigned);
+static bool uring_recv(struct ev_loop*, Request*);
+static void uring_on_recv(struct ev_loop*, Request*, int, unsigned);
+#endif
 
 
-void server_run(ServerInfo* server_info)
+static void
+thread_info_init(ThreadInfo* thread_info, ServerInfo* server_info, int index)
 {
     struct ev_loop* mainloop = ev_loop_new(0);
 
-    ThreadInfo thread_info;
-    thread_info.server_info = server_info;
-    ev_set_userdata(mainloop, &thread_info);
+    thread_info->server_info = server_info;
+    thread_info->loop = mainloop;
+    thread_info->index = index;
+    RequestPool_init(&thread_info->request_pool);
+    BufferPool_init(&thread_info->buffer_pool);
+    Timeouts_init(&thread_info->timeouts, mainloop, ev_timer_on_timeout);
+    thread_info->timeouts.durations[TIMEOUT_READ] = server_info->read_timeout;
+    thread_info->timeouts.durations[TIMEOUT_HEADER] = server_info->header_timeout;
+    thread_info->timeouts.durations[TIMEOUT_BODY] = server_info->body_timeout;
+    thread_info->timeouts.durations[TIMEOUT_WRITE] = server_info->write_timeout;
+    thread_info->timeouts.durations[TIMEOUT_KEEPALIVE] = server_info->keepalive_timeout;
+    thread_info->direct_writes = 0;
+    thread_info->deferred_writes = 0;
+    thread_info->app_done = NULL;
+    thread_info->pooled_calls = 0;
+    thread_info->pending_calls = 0;
+    pthread_mutex_init(&thread_info->app_done_lock, NULL);
+    thread_info->accept_paused = false;
+    thread_info->deferred_accepts = 0;
+    thread_info->rejected_accepts = 0;
+    thread_info->reserved_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    StaticCache_init(&thread_info->static_cache);
+#ifdef WANT_TRACING
+    memset(&thread_info->trace, 0, sizeof(trace_stats));
+#endif
+    ev_set_userdata(mainloop, thread_info);
+
+    /* The accept loop drains the backlog until EAGAIN, so the listen
+     * socket must not block. */
+    int flags = fcntl(server_info->sockfd, F_GETFL, 0);
+    fcntl(server_info->sockfd, F_SETFL, (flags < 0 ? 0 : flags) | O_NONBLOCK);
+
+#ifdef WANT_IO_URING
+    thread_info->uring = NULL;
+    if(server_info->io_uring)
+        uring_start(thread_info);
+#endif
+
+    ev_io_init(&thread_info->accept_watcher, ev_io_on_request, server_info->sockfd, EV_READ);
+    ev_timer_init(&thread_info->accept_retry_watcher, ev_timer_on_accept_retry,
+                  ACCEPT_RETRY_INTERVAL, 0.);
+    accept_watcher_start(mainloop);
 
-    ev_io_init(&thread_info.accept_watcher, ev_io_on_request, server_info->sockfd, EV_READ);
-    ev_io_start(mainloop, &thread_info.accept_watcher);
+    /* Signals are handled by the main thread's loop, which passes shutdown
+     * and statistics requests on to the others. Unref'd so that they don't
+     * keep the loop alive on shutdown. */
+    ev_async_init(&thread_info->shutdown_watcher, ev_async_on_shutdown);
+    ev_async_start(mainloop, &thread_info->shutdown_watcher);
+    ev_unref(mainloop);
+    ev_async_init(&thread_info->stats_watcher, ev_async_on_stats);
+    ev_async_start(mainloop, &thread_info->stats_watcher);
+    ev_unref(mainloop);
+    /* Pending app calls keep the loop alive, see submit_app_call() */
+    ev_async_init(&thread_info->app_done_watcher, ev_async_on_app_done);
+    ev_async_start(mainloop, &thread_info->app_done_watcher);
+    ev_unref(mainloop);
+}
+
+static void
+thread_info_destroy(ThreadInfo* thread_info)
+{
+    ev_loop_destroy(thread_info->loop);
+#ifdef WANT_IO_URING
+    if(thread_info->uring) {
+        Uring_destroy(thread_info->uring);
+        free(thread_info->uring);
+    }
+#endif
+    RequestPool_destroy(&thread_info->request_pool);
+    BufferPool_destroy(&thread_info->buffer_pool);
+    StaticCache_destroy(&thread_info->static_cache);
+    pthread_mutex_destroy(&thread_info->app_done_lock);
+    if(thread_info->reserved_fd != -1)
+        close(thread_info->reserved_fd);
+}
+
+static void*
+run_loop_thread(void* arg)
+{
+    ThreadInfo* thread_info = arg;
+    /* Keep a thread state for the lifetime of the thread, so that GIL_LOCK
+     * doesn't create and destroy one in every callback */
+    PyGILState_STATE gilstate = PyGILState_Ensure();
+    Py_BEGIN_ALLOW_THREADS
+    ev_run(thread_info->loop, 0);
+    Py_END_ALLOW_THREADS
+    PyGILState_Release(gilstate);
+    return NULL;
+}
+
+/* Run an event loop for each of the `count` listen sockets in `server_infos`.
+ * The first one runs in the calling thread, the others in threads of their
+ * own. Every loop only holds the GIL while it calls into Python. */
+void server_run(ServerInfo* server_infos, int count)
+{
+    thread_infos = calloc(count, sizeof(ThreadInfo));
+    thread_count = count;
+    for(int i = 0; i < count; ++i)
+        thread_info_init(&thread_infos[i], &server_infos[i], i);
+
+    struct ev_loop* mainloop = thread_infos[0].loop;
+
+    /* SIGUSR1 dumps runtime statistics to stderr */
+    ev_signal sigusr1_watcher;
+    ev_signal_init(&sigusr1_watcher, ev_signal_on_sigusr1, SIGUSR1);
+    ev_signal_start(mainloop, &sigusr1_watcher);
+    ev_unref(mainloop);
 
 #if WANT_SIGINT_HANDLING
     ev_signal sigint_watcher;
@@ -92,11 +319,107 @@ void server_run(ServerInfo* server_info)
     ev_set_priority(&timeout_watcher, EV_MINPRI);
 #endif
 
+    if(server_infos[0].app_threads)
+        ThreadPool_start(&app_pool, server_infos[0].app_threads, run_app_call);
+
     /* This is the program main loop */
     Py_BEGIN_ALLOW_THREADS
+    for(int i = 1; i < count; ++i) {
+        int err = pthread_create(&thread_infos[i].thread, NULL, run_loop_thread, &thread_infos[i]);
+        if(err) {
+            fprintf(stderr, "Could not start event loop thread %d: %s\n", i, strerror(err));
+            /* Its listener would stay in the SO_REUSEPORT group and get its
+             * share of the connections, with nobody to accept them */
+            thread_info_destroy(&thread_infos[i]);
+            thread_infos[i].loop = NULL;
+            thread_infos[i].thread = 0;
+            close(server_infos[i].sockfd);
+            server_infos[i].sockfd = -1;
+        }
+    }
     ev_run(mainloop, 0);
-    ev_loop_destroy(mainloop);
+    for(int i = 1; i < count; ++i) {
+        if(thread_infos[i].thread)
+            pthread_join(thread_infos[i].thread, NULL);
+    }
+    if(server_infos[0].app_threads)
+        ThreadPool_stop(&app_pool);
+    for(int i = 0; i < count; ++i) {
+        if(thread_infos[i].loop)
+            thread_info_destroy(&thread_infos[i]);
+    }
     Py_END_ALLOW_THREADS
+
+    free(thread_infos);
+    thread_infos = NULL;
+    thread_count = 0;
+}
+
+static void
+ev_signal_on_sigusr1(struct ev_loop* mainloop, ev_signal* watcher, const int events)
+{
+    print_stats(mainloop);
+    for(int i = 1; i < thread_count; ++i) {
+        if(thread_infos[i].loop)
+            ev_async_send(thread_infos[i].loop, &thread_infos[i].stats_watcher);
+    }
+}
+
+static void
+ev_async_on_stats(struct ev_loop* mainloop, ev_async* watcher, const int events)
+{
+    print_stats(mainloop);
+}
+
+static void
+print_stats(struct ev_loop* mainloop)
+{
+    if(thread_count > 1)
+        fprintf(stderr, "[pid %d thread %d] ", getpid(), THREAD_INFO(mainloop)->index);
+    else
+        fprintf(stderr, "[pid %d] ", getpid());
+    RequestPool_print_stats(&THREAD_INFO(mainloop)->request_pool, stderr);
+    BufferPool_print_stats(&THREAD_INFO(mainloop)->buffer_pool, stderr);
+    fprintf(stderr, "writes: direct=%lu deferred=%lu\n",
+            THREAD_INFO(mainloop)->direct_writes, THREAD_INFO(mainloop)->deferred_writes);
+    if(THREAD_INFO(mainloop)->sendfile_calls)
+        fprintf(stderr, "sendfile: calls=%lu bytes=%llu (%llu per call)\n",
+                THREAD_INFO(mainloop)->sendfile_calls, THREAD_INFO(mainloop)->sendfile_bytes,
+                THREAD_INFO(mainloop)->sendfile_bytes / THREAD_INFO(mainloop)->sendfile_calls);
+    if(THREAD_INFO(mainloop)->server_info->static_route_count)
+        StaticCache_print_stats(&THREAD_INFO(mainloop)->static_cache, stderr);
+    unsigned long* expired = THREAD_INFO(mainloop)->timeouts.expired;
+    fprintf(stderr, "timeouts: read=%lu header=%lu body=%lu write=%lu keepalive=%lu\n",
+            expired[TIMEOUT_READ], expired[TIMEOUT_HEADER], expired[TIMEOUT_BODY],
+            expired[TIMEOUT_WRITE], expired[TIMEOUT_KEEPALIVE]);
+    fprintf(stderr, "accepts: deferred=%lu rejected=%lu\n",
+            THREAD_INFO(mainloop)->deferred_accepts, THREAD_INFO(mainloop)->rejected_accepts);
+#ifdef WANT_IO_URING
+    if(THREAD_INFO(mainloop)->uring)
+        fprintf(stderr, "io_uring: enters=%lu completions=%lu\n",
+                THREAD_INFO(mainloop)->uring->enters, THREAD_INFO(mainloop)->uring->completions);
+#endif
+    if(app_pool.count)
+        fprintf(stderr, "app calls: pooled=%lu pending=%lu\n",
+                THREAD_INFO(mainloop)->pooled_calls, THREAD_INFO(mainloop)->pending_calls);
+#ifdef WANT_TRACING
+    trace_print(&THREAD_INFO(mainloop)->trace, stderr);
+#endif
+}
+
+/* Stop taking new connections; the loop ends once the open ones are done */
+static void
+stop_accepting(struct ev_loop* mainloop)
+{
+    accept_watcher_stop(mainloop);
+    ev_timer_stop(mainloop, &THREAD_INFO(mainloop)->accept_retry_watcher);
+    THREAD_INFO(mainloop)->accept_paused = false; /* for good */
+}
+
+static void
+ev_async_on_shutdown(struct ev_loop* mainloop, ev_async* watcher, const int events)
+{
+    stop_accepting(mainloop);
 }
 
 #if WANT_SIGINT_HANDLING
@@ -116,7 +439,11 @@ ev_signal_on_sigint(struct ev_loop* mainloop, ev_signal* watcher, const int even
     ev_cleanup_init(cleanup_watcher, pyerr_set_interrupt);
     ev_cleanup_start(mainloop, cleanup_watcher);
 
-    ev_io_stop(mainloop, &((ThreadInfo*)ev_userdata(mainloop))->accept_watcher);
+    stop_accepting(mainloop);
+    for(int i = 1; i < thread_count; ++i) {
+        if(thread_infos[i].loop)
+            ev_async_send(thread_infos[i].loop, &thread_infos[i].shutdown_watcher);
+    }
     ev_signal_stop(mainloop, watcher);
 #ifdef WANT_SIGNAL_HANDLING
     ev_timer_stop(mainloop, &timeout_watcher);
@@ -124,6 +451,25 @@ ev_signal_on_sigint(struct ev_loop* mainloop, ev_signal* watcher, const int even
 }
 #endif
 
+static void
+ev_timer_on_timeout(struct ev_loop* mainloop, ev_timer* watcher, const int events)
+{
+    Timeouts* timeouts = &THREAD_INFO(mainloop)->timeouts;
+    timeout_entry* entry = Timeouts_pop_expired(timeouts);
+
+    if(entry) {
+        GIL_LOCK(0);
+        do {
+            Request* request = REQUEST_FROM_TIMEOUT(entry);
+            DBG_REQ(request, "Timed out");
+            close_connection(mainloop, request);
+        } while((entry = Timeouts_pop_expired(timeouts)));
+        GIL_UNLOCK(0);
+    }
+
+    Timeouts_rearm(timeouts);
+}
+
 #if WANT_SIGNAL_HANDLING
 static void
 ev_timer_ontick(struct ev_loop* mainloop, ev_timer* watcher, const int events)
@@ -134,122 +480,617 @@ ev_timer_ontick(struct ev_loop* mainloop, ev_timer* watcher, const int events)
 }
 #endif
 
+/* Accept a client socket with O_NONBLOCK and FD_CLOEXEC already set.
+ * Uses a single accept4() where available. */
+static int
+accept_nonblocking(int listen_fd, struct sockaddr* addr, socklen_t* addrlen)
+{
+#ifdef SOCK_NONBLOCK
+    return accept4(listen_fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int client_fd = accept(listen_fd, addr, addrlen);
+    if(client_fd < 0)
+        return -1;
+
+    int flags = fcntl(client_fd, F_GETFL, 0);
+    if(fcntl(client_fd, F_SETFL, (flags < 0 ? 0 : flags) | O_NONBLOCK) == -1) {
+        DBG("Could not set_nonblocking() client %d: errno %d", client_fd, errno);
+        close(client_fd);
+        return -1;
+    }
+    fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+    return client_fd;
+#endif
+}
+
 static void
 ev_io_on_request(struct ev_loop* mainloop, ev_io* watcher, const int events)
 {
+    ThreadInfo* thread_info = THREAD_INFO(mainloop);
+    ServerInfo* server_info = thread_info->server_info;
     int client_fd;
-    struct sockaddr_in sockaddr;
+    struct sockaddr_storage sockaddr;
     socklen_t addrlen;
 
-    addrlen = sizeof(struct sockaddr_in);
-    client_fd = accept(watcher->fd, (struct sockaddr*)&sockaddr, &addrlen);
-    if(client_fd < 0) {
-        DBG("Could not accept() client: errno %d", errno);
-        return;
-    }
+    /* Drain up to `accept_batch` pending connections per wakeup instead of
+     * going back to the loop after every single accept(). */
+    for(int i = 0; i < server_info->accept_batch; i++) {
+        if(server_info->max_connections
+           && thread_info->request_pool.in_use >= (size_t)server_info->max_connections) {
+            /* Leave further connections in the listen backlog until one
+             * of ours closes */
+            thread_info->deferred_accepts++;
+            pause_accepting(mainloop, false);
+            return;
+        }
 
-    int flags = fcntl(client_fd, F_GETFL, 0);
-    if(fcntl(client_fd, F_SETFL, (flags < 0 ? 0 : flags) | O_NONBLOCK) == -1) {
-        DBG("Could not set_nonblocking() client %d: errno %d", client_fd, errno);
-        return;
+        addrlen = sizeof(sockaddr);
+        client_fd = accept_nonblocking(watcher->fd, (struct sockaddr*)&sockaddr, &addrlen);
+        if(client_fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno == EMFILE || errno == ENFILE) {
+                /* The listen socket stays readable, so don't just return */
+                if(reject_connection(thread_info, watcher->fd))
+                    continue;
+                pause_accepting(mainloop, true);
+                return;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                DBG("Could not accept() client: errno %d", errno);
+            return;
+        }
+
+        new_connection(mainloop, client_fd, (struct sockaddr*)&sockaddr, addrlen);
     }
+}
 
-    GIL_LOCK(0);
+/* Set up a Request for a newly accepted client and wait for its request */
+static void
+new_connection(struct ev_loop* mainloop, int client_fd, struct sockaddr* addr, socklen_t addrlen)
+{
+    ThreadInfo* thread_info = THREAD_INFO(mainloop);
 
+    /* Responses are coalesced into as few writes as possible already
+     * (see wsgi_queue_chunks), so Nagle's algorithm would only delay the
+     * last segment of every write. */
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    /* No Python objects are created here (REMOTE_ADDR is formatted
+     * lazily), so there's no need to take the GIL. */
     Request* request = Request_new(
-                           ((ThreadInfo*)ev_userdata(mainloop))->server_info,
+                           &thread_info->request_pool,
+                           &thread_info->buffer_pool,
+                           thread_info->server_info,
                            client_fd,
-                           inet_ntoa(sockaddr.sin_addr)
+                           addr,
+                           addrlen
                        );
 
-    GIL_UNLOCK(0);
-
-    DBG_REQ(request, "Accepted client %s:%d on fd %d",
-            inet_ntoa(sockaddr.sin_addr), ntohs(sockaddr.sin_port), client_fd);
+    DBG_REQ(request, "Accepted client on fd %d", client_fd);
 
     ev_io_init(&request->ev_watcher, &ev_io_on_read,
                client_fd, EV_READ);
-    ev_io_start(mainloop, &request->ev_watcher);
+    start_watcher(mainloop, request);
+    Timeouts_set(&thread_info->timeouts, &request->timeout, TIMEOUT_READ);
 }
 
 static void
-ev_io_on_read(struct ev_loop* mainloop, ev_io* watcher, const int events)
+accept_watcher_start(struct ev_loop* mainloop)
 {
-    static char read_buf[READ_BUFFER_SIZE];
+#ifdef WANT_IO_URING
+    if(THREAD_INFO(mainloop)->uring) {
+        uring_accept(mainloop);
+        return;
+    }
+#endif
+    ev_io_start(mainloop, &THREAD_INFO(mainloop)->accept_watcher);
+}
 
+static void
+accept_watcher_stop(struct ev_loop* mainloop)
+{
+#ifdef WANT_IO_URING
+    if(THREAD_INFO(mainloop)->uring) {
+        uring_cancel_accept(mainloop);
+        return;
+    }
+#endif
+    ev_io_stop(mainloop, &THREAD_INFO(mainloop)->accept_watcher);
+}
+
+/* Stop the accept watcher until a connection closes. If `retry_later`,
+ * also try again after ACCEPT_RETRY_INTERVAL, since the file descriptors
+ * we're out of may be held by someone else. */
+static void
+pause_accepting(struct ev_loop* mainloop, bool retry_later)
+{
+    ThreadInfo* thread_info = THREAD_INFO(mainloop);
+    accept_watcher_stop(mainloop);
+    thread_info->accept_paused = true;
+    if(retry_later && !ev_is_active(&thread_info->accept_retry_watcher))
+        ev_timer_start(mainloop, &thread_info->accept_retry_watcher);
+}
+
+static void
+resume_accepting(struct ev_loop* mainloop)
+{
+    ThreadInfo* thread_info = THREAD_INFO(mainloop);
+    ev_timer_stop(mainloop, &thread_info->accept_retry_watcher);
+    thread_info->accept_paused = false;
+    accept_watcher_start(mainloop);
+}
+
+static void
+ev_timer_on_accept_retry(struct ev_loop* mainloop, ev_timer* watcher, const int events)
+{
+    resume_accepting(mainloop);
+}
+
+/* Out of file descriptors: free the reserved one to accept the next pending
+ * connection, answer it with a 503 and close it. Returns false if that
+ * didn't work either. */
+static bool
+reject_connection(ThreadInfo* thread_info, int listen_fd)
+{
+    if(thread_info->reserved_fd == -1)
+        return false;
+    close(thread_info->reserved_fd);
+
+    int client_fd = accept_nonblocking(listen_fd, NULL, NULL);
+    if(client_fd >= 0) {
+        /* Best effort; the connection is closed either way */
+        if(write(client_fd, http_busy_message, sizeof(http_busy_message) - 1) == -1)
+            DBG("Could not send 503 to rejected client: errno %d", errno);
+        close(client_fd);
+        thread_info->rejected_accepts++;
+    }
+
+    thread_info->reserved_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return client_fd >= 0;
+}
+
+static void
+ev_io_on_read(struct ev_loop* mainloop, ev_io* watcher, const int events)
+{
     Request* request = REQUEST_FROM_WATCHER(watcher);
-    read_state read_state;
+    ssize_t read_bytes;
 
-    ssize_t read_bytes = read(
-                             request->client_fd,
-                             read_buf,
-                             READ_BUFFER_SIZE
-                         );
+    if(Request_get_read_buffer(request)) {
+        read_bytes = read(
+                         request->client_fd,
+                         request->read_buf,
+                         BUFFER_CLASS_SIZE(request->read_buf_class)
+                     );
+    } else {
+        read_bytes = -1;
+        errno = ENOMEM;
+    }
 
-    GIL_LOCK(0);
+    if (read_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        /* Spurious wakeup; nothing to do */
+        Request_put_read_buffer(request);
+        return;
+    }
 
-    if (read_bytes == 0) {
-        /* Client disconnected */
-        read_state = aborted;
-        DBG_REQ(request, "Client disconnected");
-    } else if (read_bytes < 0) {
-        /* Would block or error */
-        if(errno == EAGAIN || errno == EWOULDBLOCK) {
-            read_state = not_yet_done;
-        } else {
-            read_state = aborted;
+    handle_read(mainloop, request, read_bytes);
+}
+
+/* Serve the `read_bytes` that have been read into the read buffer, or close
+ * the connection on EOF (0) or error (-1). Called without the GIL, which is
+ * only taken if Python is involved. */
+static void
+handle_read(struct ev_loop* mainloop, Request* request, ssize_t read_bytes)
+{
+    if (read_bytes <= 0) {
+        if(read_bytes == 0)
+            DBG_REQ(request, "Client disconnected");
+        else
             DBG_REQ(request, "Hit errno %d while read()ing", errno);
+        if(without_python(request)) {
+            close_connection(mainloop, request);
+        } else {
+            GIL_LOCK(0);
+            close_connection(mainloop, request);
+            GIL_UNLOCK(0);
         }
     } else {
-        /* OK, either expect more data or done reading */
-        Request_parse(request, read_buf, (size_t)read_bytes);
+        Request_adjust_read_class(request, (size_t)read_bytes);
+        request->read_start = 0;
+        request->read_len = (size_t)read_bytes;
+        if(serve_input(mainloop, request))
+            wait_for_io(mainloop, request);
+    }
+}
+
+/* handle_input() for callers without the GIL: requests for static files are
+ * served right away, the GIL is only taken for the rest. */
+static bool
+serve_input(struct ev_loop* mainloop, Request* request)
+{
+    if(request->server_info->static_route_count) {
+        switch(serve_static_input(mainloop, request)) {
+        case done:
+            return true;
+        case aborted:
+            return false;
+        default:
+            break;
+        }
+    }
+    GIL_LOCK(0);
+    bool open = handle_input(mainloop, request);
+    GIL_UNLOCK(0);
+    return open;
+}
+
+/* Like handle_input(), for as long as the input holds static file requests.
+ * Returns `done` if the connection waits for I/O now, `aborted` if it has
+ * been closed, or `not_yet_done` if the rest of the input is for the
+ * application (or not enough of it has arrived to tell). */
+static read_state
+serve_static_input(struct ev_loop* mainloop, Request* request)
+{
+    ServerInfo* server_info = request->server_info;
+
+    while(true) {
+        const char* data = request->read_buf + request->read_start;
+        size_t len = request->read_len;
+
+        if(!without_python(request))
+            return not_yet_done;
+        if(len == 0) {
+            start_watcher(mainloop, request);
+            return done;
+        }
+        if(request->state.message_begun
+           ? !(request->state.url_complete && request->state.static_request)
+           : !Static_request_line(server_info, data, len))
+            return not_yet_done;
+
+        request->read_len = 0;
+        size_t parsed = Request_parse(request, data, len);
+        if(parsed < len) {
+            /* Keep the start of pipelined requests until the current one is done */
+            request->read_start = data + parsed - request->read_buf;
+            request->read_len = len - parsed;
+        }
+
+        if(request->state.error_code) {
+            DBG_REQ(request, "Parse error");
+            request->state.keep_alive = false;
+            request->read_len = 0;
+            if(!queue_error_response(request, request->state.error_code)) {
+                close_connection(mainloop, request);
+                return aborted;
+            }
+        } else if(!request->state.parse_finished) {
+            /* Wait for more data */
+            start_watcher(mainloop, request);
+            return done;
+        } else if(!Static_prepare_response(&THREAD_INFO(mainloop)->static_cache,
+                                           request, ev_now(mainloop))) {
+            close_connection(mainloop, request);
+            return aborted;
+        }
+
+        if(!send_response(mainloop, request))
+            return aborted;
+        if(request->read_len == 0 || (request->ev_watcher.events & EV_WRITE))
+            return done;
+        /* Go on with the pipelined requests that came in with the last one */
+    }
+}
+
+/* True if no Python objects are attached to the connection, so it can be
+ * handled without the GIL: it's waiting for a request, or serving a static
+ * file, and no response data owned by Python objects is waiting to be sent. */
+static bool
+without_python(Request* request)
+{
+    return (!request->state.message_begun || request->state.static_request)
+           && (request->output == NULL || !OutputQueue_has_owners(request->output));
+}
+
+/* Serve the requests in the unparsed part of the read buffer until more
+ * input is needed, a response has to wait for the socket to become writable
+ * or the application is called by an app thread. Returns false if the
+ * connection has been closed. */
+static bool
+handle_input(struct ev_loop* mainloop, Request* request)
+{
+    while(true) {
+        const char* data = request->read_buf + request->read_start;
+        size_t len = request->read_len;
+        request->read_len = 0;
+
+        read_state read_state = parse_requests(mainloop, request, &data, &len);
+        if(read_state == aborted) {
+            close_connection(mainloop, request);
+            return false;
+        }
+        if(len) {
+            /* Keep the start of pipelined requests until the current one is done */
+            request->read_start = data - request->read_buf;
+            request->read_len = len;
+        }
+        if(read_state == offloaded) {
+            submit_app_call(mainloop, request);
+            return true;
+        }
+        if(read_state == not_yet_done
+           && (request->output == NULL || OutputQueue_EMPTY(request->output))) {
+            /* Wait for more data */
+            start_watcher(mainloop, request);
+            return true;
+        }
+
+        if(!send_response(mainloop, request))
+            return false;
+        if((request->read_len == 0 && !EARLY_DISPATCH_PENDING(request))
+           || (request->ev_watcher.events & EV_WRITE))
+            return true;
+        /* Go on with the pipelined requests that came in with the last one */
+    }
+}
+
+/* Parse `*data` and call the application for the requests in it. Pipelined
+ * requests are served back to back as long as the previous response could
+ * be queued completely, so that their responses are sent together.
+ * Returns `done` if there's a response to send, with `*data` and `*len`
+ * set to what's left for the next request, `offloaded` if the app is to
+ * be called by an app thread, or `not_yet_done` if more input is needed or
+ * the queued responses have to be sent first. */
+static read_state
+parse_requests(struct ev_loop* mainloop, Request* request, const char** data, size_t* len)
+{
+    while(*len || EARLY_DISPATCH_PENDING(request)) {
+        if(*len) {
+            TRACE_START(parse_start);
+            size_t parsed = Request_parse(request, *data, *len);
+            TRACE_END(&THREAD_INFO(mainloop)->trace, TRACE_PARSE, parse_start);
+            *data += parsed;
+            *len -= parsed;
+        }
+
         if(request->state.error_code) {
             /* HTTP parse error */
-            read_state = done;
             DBG_REQ(request, "Parse error");
-            request->current_chunk = _PEP3333_Bytes_FromString(
-                                         http_error_messages[request->state.error_code]);
             assert(request->iterator == NULL);
-        } else if(request->state.parse_finished) {
-            /* HTTP parse successful */
-            read_state = done;
-            bool wsgi_ok = wsgi_call_application(request);
-            if (!wsgi_ok) {
-                /* Response is "HTTP 500 Internal Server Error" */
-                DBG_REQ(request, "WSGI app error");
-                assert(PyErr_Occurred());
-                PyErr_Print();
-                assert(!request->state.chunked_response);
-                Py_XCLEAR(request->iterator);
-                request->current_chunk = _PEP3333_Bytes_FromString(
-                                             http_error_messages[HTTP_SERVER_ERROR]);
-            }
-        } else {
+            request->state.keep_alive = false;
+            *len = 0;
+            if(!queue_error_response(request, request->state.error_code))
+                return aborted;
+            return done;
+        }
+
+        if(!request->state.parse_finished && !request->state.headers_finished) {
             /* Wait for more data */
-            read_state = not_yet_done;
+            assert(*len == 0);
+            break;
+        }
+
+        if(request->state.static_request) {
+            if(!Static_prepare_response(&THREAD_INFO(mainloop)->static_cache,
+                                        request, ev_now(mainloop)))
+                return aborted;
+        } else {
+            /* HTTP parse successful (or, in early dispatch mode, the
+             * headers are complete and the body is read on demand) */
+            if(!request->state.parse_finished) {
+                /* The app may send 100 Continue, and the client may wait
+                 * for the earlier responses before sending the body */
+                if(request->output && !OutputQueue_EMPTY(request->output))
+                    return not_yet_done;
+                request->state.body_streaming = true;
+            }
+            if(app_pool.count) {
+                /* The app thread can't take an output queue from the pool */
+                if(!Request_get_output(request))
+                    return aborted;
+                return offloaded;
+            }
+
+            TRACE_START(wsgi_start);
+            bool queued = call_application(request);
+            TRACE_END(&THREAD_INFO(mainloop)->trace, TRACE_WSGI_CALL, wsgi_start);
+            if(!queued)
+                return aborted;
         }
+
+        if(*len == 0 || !response_queued(request))
+            return done;
+
+        DBG_REQ(request, "Response queued, continue with pipelined request");
+        Request_clean(request);
+        Request_reset(request);
     }
+    return not_yet_done;
+}
 
-    switch (read_state) {
-    case not_yet_done:
-        break;
-    case done:
-        DBG_REQ(request, "Stop read watcher, start write watcher");
-        ev_io_stop(mainloop, &request->ev_watcher);
-        ev_io_init(&request->ev_watcher, &ev_io_on_write,
-                   request->client_fd, EV_WRITE);
-        ev_io_start(mainloop, &request->ev_watcher);
-        break;
-    case aborted:
-        close_connection(mainloop, request);
-        break;
+/* Call the application for the current request and prepare its response,
+ * or a 500 error if it failed. Returns false if not even that was possible. */
+static bool
+call_application(Request* request)
+{
+    if(wsgi_call_application(request))
+        return true;
+
+    /* Response is "HTTP 500 Internal Server Error" */
+    DBG_REQ(request, "WSGI app error");
+    assert(PyErr_Occurred());
+    PyErr_Print();
+    /* Nothing has been queued yet, but the response iterator may
+     * have raised after the headers were prepared. */
+    request->state.chunked_response = false;
+    request->state.keep_alive = false;
+    Py_XCLEAR(request->iterator);
+    if(SENDFILE_RESPONSE(request)) {
+        /* Don't send the file after the error message */
+        FileWrapper_Done(request->iterable);
+        Py_CLEAR(request->iterable);
     }
+    return queue_error_response(request, HTTP_SERVER_ERROR);
+}
 
+/* Leave the application call to an app thread. The connection's watcher
+ * and timeout are stopped until the call is done, see ev_async_on_app_done(). */
+static void
+submit_app_call(struct ev_loop* mainloop, Request* request)
+{
+    ThreadInfo* thread_info = THREAD_INFO(mainloop);
+    ev_io_stop(mainloop, &request->ev_watcher);
+    Timeouts_clear(&request->timeout);
+    /* Keep the loop alive in place of the watcher */
+    ev_ref(mainloop);
+    thread_info->pooled_calls++;
+    thread_info->pending_calls++;
+    request->app_pending = true;
+    request->app_loop = mainloop;
+    ThreadPool_submit(&app_pool, request);
+}
+
+/* Runs in an app thread */
+static void
+run_app_call(Request* request)
+{
+    struct ev_loop* mainloop = request->app_loop;
+    ThreadInfo* thread_info = THREAD_INFO(mainloop);
+
+    /* Not counting the time spent waiting for a free app thread */
+    TRACE_SET(request->app_started);
+    request->app_failed = !call_application(request);
+
+    pthread_mutex_lock(&thread_info->app_done_lock);
+    request->app_next = thread_info->app_done;
+    thread_info->app_done = request;
+    pthread_mutex_unlock(&thread_info->app_done_lock);
+    /* The loop owns the Request again */
+    ev_async_send(mainloop, &thread_info->app_done_watcher);
+}
+
+static void
+ev_async_on_app_done(struct ev_loop* mainloop, ev_async* watcher, const int events)
+{
+    ThreadInfo* thread_info = THREAD_INFO(mainloop);
+
+    pthread_mutex_lock(&thread_info->app_done_lock);
+    Request* request = thread_info->app_done;
+    thread_info->app_done = NULL;
+    pthread_mutex_unlock(&thread_info->app_done_lock);
+    if(request == NULL)
+        return;
+
+    GIL_LOCK(0);
+    do {
+        Request* next = request->app_next;
+        request->app_next = NULL;
+        request->app_pending = false;
+        thread_info->pending_calls--;
+        ev_unref(mainloop);
+        TRACE_END(&thread_info->trace, TRACE_WSGI_CALL, request->app_started);
+
+        bool open;
+        if(request->app_failed) {
+            close_connection(mainloop, request);
+            open = false;
+        } else if(request->read_len && response_queued(request)) {
+            /* Queue the responses to the pipelined requests behind this one */
+            DBG_REQ(request, "Response queued, continue with pipelined request");
+            Request_clean(request);
+            Request_reset(request);
+            /* Not started yet: the next request may go to an app thread */
+            ev_io_init(&request->ev_watcher, ev_io_on_read, request->client_fd, EV_READ);
+            open = handle_input(mainloop, request);
+        } else {
+            open = send_response(mainloop, request)
+                   && (request->read_len == 0 || (request->ev_watcher.events & EV_WRITE)
+                       || handle_input(mainloop, request));
+        }
+        if(open)
+            wait_for_io(mainloop, request);
+        request = next;
+    } while(request);
     GIL_UNLOCK(0);
 }
 
+/* Send the response that has been prepared. Returns false if the connection
+ * has been closed; otherwise it either waits for EV_WRITE or is ready for
+ * the next request. */
+static bool
+send_response(struct ev_loop* mainloop, Request* request)
+{
+    TRACE_SET(request->write_started);
+    /* The socket is almost always writable here, so try to send the
+     * response right away instead of waiting for EV_WRITE. */
+    write_state write_state = write_response(mainloop, request);
+    if(write_state == not_yet_done) {
+        DBG_REQ(request, "Stop read watcher, start write watcher");
+        THREAD_INFO(mainloop)->deferred_writes++;
+        switch_watcher(mainloop, request, ev_io_on_write, EV_WRITE);
+        return true;
+    }
+    THREAD_INFO(mainloop)->direct_writes++;
+    return finish_response(mainloop, request, write_state);
+}
+
+/* Done with the connection until its socket is ready again: return the read
+ * buffer if it's empty, and the output queue unless a response is still
+ * being written, and arm the timeout. Nothing to do while an app thread has
+ * the Request. */
+static void
+wait_for_io(struct ev_loop* mainloop, Request* request)
+{
+    if(request->app_pending)
+        return;
+    Request_put_read_buffer(request);
+    if(!(request->ev_watcher.events & EV_WRITE))
+        Request_put_output(request);
+    update_timeout(mainloop, request);
+}
+
+/* True if the response to a pipelined request is queued completely and the
+ * next request's response may be queued behind it. */
+static bool
+response_queued(Request* request)
+{
+    return request->state.keep_alive
+           && request->state.parse_finished
+           && request->iterator == NULL
+           && !request->state.chunked_response /* terminating chunk queued */
+           && !SENDFILE_RESPONSE(request)
+           && !request->state.static_request /* `static_scratch` is reused */
+           && OutputQueue_space(request->output) >= OUTPUT_QUEUE_SIZE / 2
+           && request->output->size < (size_t)request->server_info->write_budget;
+}
+
 static void
 ev_io_on_write(struct ev_loop* mainloop, ev_io* watcher, const int events)
+{
+    Request* request = REQUEST_FROM_WATCHER(watcher);
+    /* Static file responses are sent without the GIL */
+    bool gil = !without_python(request);
+    PyGILState_STATE gilstate;
+    if(gil)
+        gilstate = PyGILState_Ensure();
+
+    write_state write_state = write_response(mainloop, request);
+    if(write_state == not_yet_done) {
+        update_timeout(mainloop, request);
+    } else if(finish_response(mainloop, request, write_state)) {
+        /* Serve the pipelined requests that came in with the last one */
+        if((request->read_len == 0 && !EARLY_DISPATCH_PENDING(request))
+           || (gil ? handle_input(mainloop, request) : serve_input(mainloop, request)))
+            wait_for_io(mainloop, request);
+    }
+
+    if(gil)
+        PyGILState_Release(gilstate);
+}
+
+static write_state
+write_response(struct ev_loop* mainloop, Request* request)
 {
     /* Since the response writing code is fairly complex, I'll try to give a short
      * overview of the different control flow paths etc.:
@@ -259,50 +1100,124 @@ ev_io_on_write(struct ev_loop* mainloop, ev_io* watcher, const int events)
      * B) iterator/other responses
      *
      * These cases are handled by the 'on_write_sendfile' and 'on_write_chunk'
-     * routines, respectively.  They use the 'do_sendfile' and 'do_send_chunk'
+     * routines, respectively.  They use the 'do_sendfile' and 'do_send_queue'
      * routines to do the actual write()-ing. The 'do_*' routines return true if
-     * there's some data left to send in the current chunk (or, in the case of
-     * sendfile, the end of the file has not been reached yet).
+     * there's some data left in the output queue (or, in the case of sendfile,
+     * the end of the file has not been reached yet).
      *
      * When the 'do_*' routines return false, the 'on_write_*' routines have to
      * figure out if there's a next chunk to send (e.g. in the case of a response iterator).
+     *
+     * With HTTP pipelining, the output queue may also hold the responses to
+     * earlier requests while the current one hasn't been received completely;
+     * then we only flush the queue.
      */
-    Request* request = REQUEST_FROM_WATCHER(watcher);
-
-    GIL_LOCK(0);
+    if(!REQUEST_DISPATCHED(request))
+        return do_send_queue(request) ? not_yet_done : done;
 
     write_state write_state;
-    if(request->iterable && FileWrapper_CheckExact(request->iterable) && FileWrapper_GetFd(request->iterable) != -1) {
+    if(SENDFILE_RESPONSE(request)) {
         write_state = on_write_sendfile(mainloop, request);
     } else {
         write_state = on_write_chunk(mainloop, request);
     }
 
+    if(write_state != not_yet_done)
+        TRACE_END(&THREAD_INFO(mainloop)->trace, TRACE_WRITE, request->write_started);
+    return write_state;
+}
+
+/* Returns true if the connection is ready for the next request */
+static bool
+finish_response(struct ev_loop* mainloop, Request* request, write_state write_state)
+{
     switch(write_state) {
-    case not_yet_done:
-        break;
     case done:
+        if(!REQUEST_DISPATCHED(request)) {
+            DBG_REQ(request, "flushed pipelined responses");
+            if(EARLY_DISPATCH_PENDING(request)) {
+                /* The caller hands the request to an app thread, which reads
+                 * the body itself; with io_uring, a recv started now would
+                 * take it away */
+                ev_io_stop(mainloop, &request->ev_watcher);
+                ev_io_init(&request->ev_watcher, ev_io_on_read, request->client_fd, EV_READ);
+                return true;
+            }
+            switch_watcher(mainloop, request, ev_io_on_read, EV_READ);
+            return true;
+        }
         if(request->state.keep_alive) {
             DBG_REQ(request, "done, keep-alive");
-            ev_io_stop(mainloop, &request->ev_watcher);
             Request_clean(request);
             Request_reset(request);
-            ev_io_init(&request->ev_watcher, &ev_io_on_read,
-                       request->client_fd, EV_READ);
-            ev_io_start(mainloop, &request->ev_watcher);
+            switch_watcher(mainloop, request, ev_io_on_read, EV_READ);
+            Timeouts_set(&THREAD_INFO(mainloop)->timeouts, &request->timeout, TIMEOUT_KEEPALIVE);
+            return true;
         } else {
             DBG_REQ(request, "done, close");
             close_connection(mainloop, request);
+            return false;
         }
-        break;
     case aborted:
         /* Response was aborted due to an error. We can't do anything graceful here
          * because at least one chunk is already sent... just close the connection. */
         close_connection(mainloop, request);
-        break;
+        return false;
+    default:
+        assert(0);
+        return false;
+    }
+}
+
+/* Arm the timeout for whatever the connection is waiting for now. The
+ * header timeout covers all of the headers, the others are restarted on
+ * every bit of progress. */
+static void
+update_timeout(struct ev_loop* mainloop, Request* request)
+{
+    int kind;
+    if(request->ev_watcher.events & EV_WRITE) {
+        kind = TIMEOUT_WRITE;
+    } else if(!request->state.message_begun) {
+        /* Nothing of the next request yet */
+        if(request->timeout.kind == TIMEOUT_READ || request->timeout.kind == TIMEOUT_KEEPALIVE)
+            return;
+        kind = TIMEOUT_KEEPALIVE;
+    } else if(!request->state.headers_parsed) {
+        if(request->timeout.kind == TIMEOUT_HEADER)
+            return;
+        kind = TIMEOUT_HEADER;
+    } else {
+        kind = TIMEOUT_BODY;
     }
+    Timeouts_set(&THREAD_INFO(mainloop)->timeouts, &request->timeout, kind);
+}
 
-    GIL_UNLOCK(0);
+static void
+switch_watcher(struct ev_loop* mainloop, Request* request, ev_io_callback* callback, int events)
+{
+    ev_io_stop(mainloop, &request->ev_watcher);
+    ev_io_init(&request->ev_watcher, callback, request->client_fd, events);
+    start_watcher(mainloop, request);
+}
+
+/* Wait for what the connection's watcher is set up for, unless it already
+ * does. With io_uring, waiting for input means a recv is in flight. */
+static void
+start_watcher(struct ev_loop* mainloop, Request* request)
+{
+    if(ev_is_active(&request->ev_watcher))
+        return;
+#ifdef WANT_IO_URING
+    if(THREAD_INFO(mainloop)->uring && (request->ev_watcher.events & EV_READ)) {
+        /* Unlike the watcher, a recv takes input away, so it mustn't start
+         * before the pipelined requests in the read buffer are served.
+         * handle_input() calls us again when it needs more. */
+        if(request->read_len || uring_recv(mainloop, request))
+            return;
+    }
+#endif
+    ev_io_start(mainloop, &request->ev_watcher);
 }
 
 static write_state
@@ -311,64 +1226,71 @@ on_write_sendfile(struct ev_loop* mainloop, Request* request)
     /* A sendfile response is split into two phases:
      * Phase A) sending HTTP headers
      * Phase B) sending the actual file contents
+     * multipart/byteranges responses go through both for every part.
      */
-    if(request->current_chunk) {
-        /* Phase A) -- current_chunk contains the HTTP headers */
-        do_send_chunk(request);
-        // Either we have headers left to send, or current_chunk has been set to
-        // NULL and we'll fall into Phase B) on the next invocation.
-        return not_yet_done;
-    } else {
+    do {
+        if(!OutputQueue_EMPTY(request->output)) {
+            /* Phase A) -- the output queue contains the HTTP headers */
+            if(do_send_queue(request))
+                // Headers left to send
+                return not_yet_done;
+            // Headers sent, continue with Phase B) right away
+        }
+
         /* Phase B) */
-        if (do_sendfile(request)) {
-            // Haven't reached the end of file yet
+        if (do_sendfile(mainloop, request))
+            // Haven't reached the end of file (or range) yet
             return not_yet_done;
-        } else {
-            // Done with the file
-            return done;
-        }
+    } while(next_range(request));
+
+    // Done with the file
+    if(request->iterable)
+        FileWrapper_Done(request->iterable);
+    return done;
+}
+
+/* Range responses: move on to the next range, queueing its part header */
+static bool
+next_range(Request* request)
+{
+    if(request->range_index + 1 >= request->range_count)
+        return false;
+    request->range_index++;
+    request->file_offset = request->ranges[request->range_index].start;
+    if(request->range_heads) {
+        PyObject* head = PyList_GET_ITEM(request->range_heads, request->range_index);
+        Py_INCREF(head);
+        OutputQueue_push(request->output, _PEP3333_Bytes_AS_DATA(head),
+                         _PEP3333_Bytes_GET_SIZE(head), head);
     }
+    return true;
 }
 
 
 static write_state
 on_write_chunk(struct ev_loop* mainloop, Request* request)
 {
-    if (do_send_chunk(request))
-        // data left to send in the current chunk
+    if (do_send_queue(request))
+        // data left to send in the output queue
         return not_yet_done;
 
     if(request->iterator) {
-        /* Reached the end of a chunk in the response iterator. Get next chunk. */
-        PyObject* next_chunk = wsgi_iterable_get_next_chunk(request);
-        if(next_chunk) {
-            /* We found another chunk to send. */
-            if(request->state.chunked_response) {
-                request->current_chunk = wrap_http_chunk_cruft_around(next_chunk);
-                Py_DECREF(next_chunk);
-            } else {
-                request->current_chunk = next_chunk;
-            }
-            assert(request->current_chunk_p == 0);
-            return not_yet_done;
-
-        } else {
-            if(PyErr_Occurred()) {
-                /* Trying to get the next chunk raised an exception. */
-                PyErr_Print();
-                DBG_REQ(request, "Exception in iterator, can not recover");
-                return aborted;
-            } else {
-                /* This was the last chunk; cleanup. */
-                Py_CLEAR(request->iterator);
-                goto send_terminator_chunk;
-            }
+        /* Sent everything we had. Get the next chunks. */
+        if(!wsgi_queue_chunks(request)) {
+            /* Trying to get the next chunk raised an exception. */
+            PyErr_Print();
+            DBG_REQ(request, "Exception in iterator, can not recover");
+            return aborted;
         }
+        if(OutputQueue_EMPTY(request->output))
+            /* The iterator was exhausted and there's no terminator to send */
+            return done;
+        return not_yet_done;
     } else {
         /* We have no iterator to get more chunks from, so we're done.
          * Reasons we might end up in this place:
          * A) A parse or server error occurred
-         * C) We just finished a chunked response with the call to 'do_send_chunk'
+         * C) We just finished a chunked response with the call to 'do_send_queue'
          *    above and now maybe have to send the terminating empty chunk.
          * B) We used chunked responses earlier in the response and
          *    are now sending the terminating empty chunk.
@@ -381,8 +1303,7 @@ on_write_chunk(struct ev_loop* mainloop, Request* request)
 send_terminator_chunk:
     if(request->state.chunked_response) {
         /* We have to send a terminating empty chunk + \r\n */
-        request->current_chunk = _PEP3333_Bytes_FromString("0\r\n\r\n");
-        assert(request->current_chunk_p == 0);
+        OutputQueue_push(request->output, "0\r\n\r\n", 5, NULL);
         // Next time we get here, don't send the terminating empty chunk again.
         // XXX This is kind of a hack and should be refactored for easier understanding.
         request->state.chunked_response = false;
@@ -392,58 +1313,96 @@ send_terminator_chunk:
     }
 }
 
-/* Return true if there's data left to send, false if we reached the end of the chunk. */
+/* Queue a canned error response. The output queue may hold the responses
+ * to earlier pipelined requests, but nothing of the current one. */
 static bool
-do_send_chunk(Request* request)
+queue_error_response(Request* request, int error_code)
 {
-    Py_ssize_t bytes_sent;
-
-    assert(request->current_chunk != NULL);
-    assert(!(request->current_chunk_p == _PEP3333_Bytes_GET_SIZE(request->current_chunk)
-             && _PEP3333_Bytes_GET_SIZE(request->current_chunk) != 0));
+    if(!Request_get_output(request))
+        return false;
+    const char* message = http_error_messages[error_code];
+    OutputQueue_push(request->output, message, strlen(message), NULL);
+    return true;
+}
 
-    bytes_sent = write(
-                     request->client_fd,
-                     _PEP3333_Bytes_AS_DATA(request->current_chunk) + request->current_chunk_p,
-                     _PEP3333_Bytes_GET_SIZE(request->current_chunk) - request->current_chunk_p
-                 );
+/* Return true if there's data left to send, false if the output queue is empty. */
+static bool
+do_send_queue(Request* request)
+{
+    assert(!OutputQueue_EMPTY(request->output));
 
-    if(bytes_sent == -1)
+    if(OutputQueue_send(request->output, request->client_fd) == -1)
         return handle_nonzero_errno(request);
 
-    request->current_chunk_p += bytes_sent;
-    if(request->current_chunk_p == _PEP3333_Bytes_GET_SIZE(request->current_chunk)) {
-        Py_CLEAR(request->current_chunk);
-        request->current_chunk_p = 0;
-        return false;
-    }
-    return true;
+    return !OutputQueue_EMPTY(request->output);
 }
 
-/* Return true if there's data left to send, false if we reached the end of the file. */
+/* Return true if there's data left to send, false if we reached the end of
+ * the file (or of the current range, see next_range()). */
 static bool
-do_sendfile(Request* request)
-{
-    Py_ssize_t bytes_sent = portable_sendfile(
-                                request->client_fd,
-                                FileWrapper_GetFd(request->iterable),
-                                request->current_chunk_p
-                            );
-    switch(bytes_sent) {
-    case -1:
-        if (handle_nonzero_errno(request)) {
-            return true;
+do_sendfile(struct ev_loop* mainloop, Request* request)
+{
+    Py_ssize_t bytes_sent;
+    int file_fd;
+    /* Ask for the rest of the file (or the app's blocksize) at once; the
+     * kernel stops when the socket buffer is full. */
+    size_t max_count = 0;
+    if(request->static_file) {
+        file_fd = request->static_file->fd;
+    } else {
+        file_fd = FileWrapper_GetFd(request->iterable);
+        max_count = FileWrapper_GetSendfileCount(request->iterable);
+    }
+    if(max_count == 0)
+        max_count = SENDFILE_MAX_COUNT;
+    /* Static files are also sent without the GIL */
+    bool gil = PyGILState_Check();
+
+    while(true) {
+        size_t count = max_count;
+        if(request->range_count) {
+            off_t left = request->ranges[request->range_index].end - request->file_offset;
+            if(left == 0)
+                return false;
+            if((off_t)count > left)
+                count = left;
+        }
+        if(gil) {
+            /* May have to wait for the disk; let the other loops run meanwhile */
+            Py_BEGIN_ALLOW_THREADS
+            bytes_sent = portable_sendfile(request->client_fd, file_fd, request->file_offset, count);
+            Py_END_ALLOW_THREADS
         } else {
-            FileWrapper_Done(request->iterable);
+            bytes_sent = portable_sendfile(request->client_fd, file_fd, request->file_offset, count);
+        }
+        THREAD_INFO(mainloop)->sendfile_calls++;
+
+        switch(bytes_sent) {
+        case -1:
+            if (handle_nonzero_errno(request))
+                return true;
+            goto give_up;
+        case 0:
+            if(request->range_count) {
+                /* The file has shrunk; we can't send what we promised */
+                request->state.keep_alive = false;
+                goto give_up;
+            }
             return false;
+        default:
+            THREAD_INFO(mainloop)->sendfile_bytes += bytes_sent;
+            request->file_offset += bytes_sent;
+            if((size_t)bytes_sent < count)
+                /* The socket buffer is full */
+                return true;
+            /* All of it went out, so the socket may take more */
         }
-    case 0:
-        FileWrapper_Done(request->iterable);
-        return false;
-    default:
-        request->current_chunk_p += bytes_sent;
-        return true;
     }
+
+give_up:
+    /* Skip the remaining ranges, if any */
+    request->range_index = request->range_count;
+    return false;
 }
 
 static bool
@@ -455,7 +1414,7 @@ handle_nonzero_errno(Request* request)
     } else {
         /* Serious transmission failure. Hang up. */
         fprintf(stderr, "Client %d hit errno %d\n", request->client_fd, errno);
-        Py_XDECREF(request->current_chunk);
+        OutputQueue_clear(request->output);
         Py_XCLEAR(request->iterator);
         request->state.keep_alive = false;
         return false;
@@ -467,6 +1426,250 @@ close_connection(struct ev_loop* mainloop, Request* request)
 {
     DBG_REQ(request, "Closing socket");
     ev_io_stop(mainloop, &request->ev_watcher);
+    Timeouts_clear(&request->timeout);
+#ifdef WANT_IO_URING
+    if(request->recv_pending) {
+        /* Shutting the socket down completes the recv, and uring_on_recv()
+         * releases the Request then */
+        shutdown(request->client_fd, SHUT_RDWR);
+        close(request->client_fd);
+        request->closing = true;
+        return;
+    }
+#endif
     close(request->client_fd);
-    Request_free(request);
+    release_request(mainloop, request);
+}
+
+static void
+release_request(struct ev_loop* mainloop, Request* request)
+{
+    Request_free(&THREAD_INFO(mainloop)->request_pool, request);
+    if(THREAD_INFO(mainloop)->accept_paused)
+        resume_accepting(mainloop);
+}
+
+
+#ifdef WANT_IO_URING
+/* user_data of the ring's operations. Requests are aligned, so a set low bit
+ * marks the multishot accept, with its generation in the upper bits. */
+#define URING_CANCEL 0
+#define URING_ACCEPT 1
+#define URING_ACCEPT_ID(thread_info) (((uint64_t)(thread_info)->accept_gen << 1) | URING_ACCEPT)
+
+/* Falls back to libev if io_uring isn't available */
+static void
+uring_start(ThreadInfo* thread_info)
+{
+    struct ev_loop* mainloop = thread_info->loop;
+    Uring* uring = malloc(sizeof(Uring));
+    if(uring == NULL || !Uring_init(uring, URING_ENTRIES, URING_BUFFERS,
+                                       BUFFER_CLASS_SIZE(URING_BUFFER_CLASS))) {
+        if(thread_info->index == 0)
+            fprintf(stderr, "io_uring is not available (errno %d), using libev\n", errno);
+        free(uring);
+        return;
+    }
+    thread_info->uring = uring;
+    thread_info->accept_armed = false;
+    thread_info->accept_gen = 0;
+
+    /* Neither keeps the loop alive: pending accepts and recvs do */
+    ev_io_init(&thread_info->uring_watcher, ev_io_on_uring, uring->fd, EV_READ);
+    ev_io_start(mainloop, &thread_info->uring_watcher);
+    ev_unref(mainloop);
+    ev_prepare_init(&thread_info->uring_prepare, ev_prepare_on_uring);
+    ev_prepare_start(mainloop, &thread_info->uring_prepare);
+    ev_unref(mainloop);
+}
+
+static void
+ev_prepare_on_uring(struct ev_loop* mainloop, ev_prepare* watcher, const int events)
+{
+    /* One syscall for everything queued during this loop iteration */
+    if(Uring_submit(THREAD_INFO(mainloop)->uring) == -1)
+        DBG("io_uring_enter() failed: errno %d", errno);
 }
+
+static void
+ev_io_on_uring(struct ev_loop* mainloop, ev_io* watcher, const int events)
+{
+    Uring* uring = THREAD_INFO(mainloop)->uring;
+    struct io_uring_cqe* cqe;
+
+    while((cqe = Uring_peek_cqe(uring))) {
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        Uring_cqe_seen(uring);
+
+        if(user_data == URING_CANCEL)
+            continue;
+        if(user_data & URING_ACCEPT)
+            uring_on_accept(mainloop, user_data, res, flags);
+        else
+            uring_on_recv(mainloop, (Request*)(uintptr_t)user_data, res, flags);
+    }
+}
+
+/* Start a multishot accept: one submission, a completion per connection */
+static void
+uring_accept(struct ev_loop* mainloop)
+{
+    ThreadInfo* thread_info = THREAD_INFO(mainloop);
+    if(thread_info->accept_armed)
+        return;
+
+    struct io_uring_sqe* sqe = Uring_get_sqe(thread_info->uring);
+    if(sqe == NULL) {
+        pause_accepting(mainloop, true);
+        return;
+    }
+    thread_info->accept_gen++;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = thread_info->server_info->sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT_ID(thread_info);
+    thread_info->accept_armed = true;
+    /* Keeps the loop alive, like the accept watcher */
+    ev_ref(mainloop);
+}
+
+static void
+uring_cancel_accept(struct ev_loop* mainloop)
+{
+    ThreadInfo* thread_info = THREAD_INFO(mainloop);
+    if(!thread_info->accept_armed)
+        return;
+
+    struct io_uring_sqe* sqe = Uring_get_sqe(thread_info->uring);
+    if(sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_ACCEPT_ID(thread_info);
+        sqe->user_data = URING_CANCEL;
+    }
+    /* Completions of the old accept don't count from now on, except for
+     * the connections it still accepts */
+    thread_info->accept_armed = false;
+    ev_unref(mainloop);
+}
+
+static void
+uring_on_accept(struct ev_loop* mainloop, uint64_t user_data, int res, unsigned flags)
+{
+    ThreadInfo* thread_info = THREAD_INFO(mainloop);
+    ServerInfo* server_info = thread_info->server_info;
+
+    if(res >= 0) {
+        /* The peer address is looked up if REMOTE_ADDR is needed */
+        new_connection(mainloop, res, NULL, 0);
+        if(server_info->max_connections
+           && thread_info->request_pool.in_use >= (size_t)server_info->max_connections) {
+            /* Connections the kernel accepts before the cancellation takes
+             * effect are still served */
+            thread_info->deferred_accepts++;
+            pause_accepting(mainloop, false);
+        }
+    }
+
+    if((flags & IORING_CQE_F_MORE) || !thread_info->accept_armed
+       || user_data != URING_ACCEPT_ID(thread_info))
+        return;
+
+    /* The kernel has ended the multishot accept */
+    thread_info->accept_armed = false;
+    ev_unref(mainloop);
+    if(res == -EMFILE || res == -ENFILE) {
+        if(!reject_connection(thread_info, server_info->sockfd)) {
+            pause_accepting(mainloop, true);
+            return;
+        }
+    } else if(res < 0) {
+        DBG("Could not accept() client: errno %d", -res);
+    }
+    uring_accept(mainloop);
+}
+
+/* Start a recv into one of the ring's buffers. Returns false if the
+ * submission queue is full. */
+static bool
+uring_recv(struct ev_loop* mainloop, Request* request)
+{
+    if(request->recv_pending)
+        return true;
+
+    struct io_uring_sqe* sqe = Uring_get_sqe(THREAD_INFO(mainloop)->uring);
+    if(sqe == NULL)
+        return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = request->client_fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)request;
+    request->recv_pending = true;
+    /* Keeps the loop alive, like the read watcher */
+    ev_ref(mainloop);
+    return true;
+}
+
+static void
+uring_on_recv(struct ev_loop* mainloop, Request* request, int res, unsigned flags)
+{
+    Uring* uring = THREAD_INFO(mainloop)->uring;
+    unsigned short bid = 0;
+    char* data = NULL;
+
+    request->recv_pending = false;
+    ev_unref(mainloop);
+    if(flags & IORING_CQE_F_BUFFER) {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        data = Uring_BUFFER(uring, bid);
+    }
+
+    if(request->closing) {
+        if(data)
+            Uring_put_buffer(uring, bid);
+        if(without_python(request)) {
+            release_request(mainloop, request);
+        } else {
+            GIL_LOCK(0);
+            release_request(mainloop, request);
+            GIL_UNLOCK(0);
+        }
+        return;
+    }
+
+    if(res == -ENOBUFS || res == -EAGAIN || res == -EINTR) {
+        /* Out of buffers because their completions haven't been handled
+         * yet; they're back by the time this recv is submitted */
+        start_watcher(mainloop, request);
+        return;
+    }
+
+    ssize_t read_bytes = res;
+    char* fresh;
+    if(res > 0 && (fresh = BufferPool_get(request->buffer_pool, URING_BUFFER_CLASS))) {
+        /* The ring's buffer becomes the connection's read buffer, and the
+         * kernel gets one from the pool in its place: the data is parsed
+         * where it was received, without a copy */
+        assert(data && request->read_len == 0);
+        Request_put_read_buffer(request);
+        request->read_buf = data;
+        request->read_buf_class = URING_BUFFER_CLASS;
+        Uring_swap_buffer(uring, bid, fresh);
+    } else {
+        if(res > 0) {
+            read_bytes = -1;
+            errno = ENOMEM;
+        } else if(res < 0) {
+            read_bytes = -1;
+            errno = -res;
+        }
+        if(data)
+            Uring_put_buffer(uring, bid);
+    }
+
+    handle_read(mainloop, request, read_bytes);
+}
+#endif
@@ -1,13 +1,67 @@
 #ifndef __server_h__
 #define __server_h__
 
+/* Max. number of connections accepted per listen socket wakeup */
+#define DEFAULT_ACCEPT_BATCH 64
+/* Request bodies larger than this are buffered in a temporary file */
+#define DEFAULT_INPUT_SPILL_THRESHOLD (1024*1024)
+/* Response iterators are drained until this many bytes are queued for one write */
+#define DEFAULT_WRITE_BUDGET (64*1024)
+/* io_uring submission queue entries and receive buffers per event loop;
+ * the buffers are of BufferPool size class 1 (16 KiB) */
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 256
+#define URING_BUFFER_CLASS 1
+/* Connection timeouts in seconds, see timeout.h */
+#define DEFAULT_READ_TIMEOUT 30
+#define DEFAULT_HEADER_TIMEOUT 30
+#define DEFAULT_BODY_TIMEOUT 60
+#define DEFAULT_WRITE_TIMEOUT 60
+#define DEFAULT_KEEPALIVE_TIMEOUT 30
+
+/* GET and HEAD requests for URLs below `prefix` are answered with the files
+ * below `root` by the server itself, see static.c */
+typedef struct {
+    const char* prefix; /* without trailing slash, "" for "/" */
+    size_t prefix_len;
+    const char* root;   /* without trailing slash */
+    size_t root_len;
+} StaticRoute;
+
 typedef struct {
     int sockfd;
     PyObject* wsgi_app;
     PyObject* host;
     PyObject* port;
+    PyObject* wsgi_base_dict; /* environ template, one per event loop */
+    int threads;              /* event loops in this process */
+    int app_threads;          /* threads calling the app, shared by all loops;
+                               * 0 = the loops call it themselves */
+    int accept_batch;
+    int max_connections; /* per event loop, 0 = unlimited */
+    int input_spill_threshold;
+    int write_budget;
+    /* Timeouts in seconds, 0 = none */
+    int read_timeout;      /* until the first request starts */
+    int header_timeout;    /* for all of the request headers */
+    int body_timeout;      /* between reads of the request body */
+    int write_timeout;     /* between writes of the response */
+    int keepalive_timeout; /* idle between requests */
+    /* Call the application as soon as the request headers are parsed
+     * and let wsgi.input read the body from the client on demand. Only
+     * with app threads, whose calls may block waiting for the body; the
+     * body is buffered before a response iterator goes on in the loop. */
+    int early_dispatch;
+    /* Accept and receive through io_uring instead of libev's readiness
+     * watchers, where available (WANT_IO_URING builds) */
+    int io_uring;
+    /* Longest prefix first */
+    StaticRoute* static_routes;
+    int static_route_count;
+    /* Send precompressed versions of wsgi.file_wrapper files, see wsgi.c */
+    int precompressed;
 } ServerInfo;
 
-void server_run(ServerInfo*);
+void server_run(ServerInfo*, int count);
 
 #endif
@@ -0,0 +1,682 @@
+#include "request.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Static file serving: requests for the URL prefixes given with --static are
+ * parsed without creating an environ (see request.c) and answered right
+ * here, so they never need the GIL. Open files and their stat() results are
+ * cached per event loop. */
+
+static const struct {
+    const char* extension;
+    const char* type;
+} content_types[] = {
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "css", "text/css; charset=utf-8" },
+    { "js", "text/javascript; charset=utf-8" },
+    { "mjs", "text/javascript; charset=utf-8" },
+    { "json", "application/json" },
+    { "map", "application/json" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "xml", "application/xml" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "avif", "image/avif" },
+    { "ico", "image/x-icon" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf", "font/ttf" },
+    { "otf", "font/otf" },
+    { "wasm", "application/wasm" },
+    { "pdf", "application/pdf" },
+    { "zip", "application/zip" },
+    { "mp3", "audio/mpeg" },
+    { "ogg", "audio/ogg" },
+    { "mp4", "video/mp4" },
+    { "webm", "video/webm" },
+};
+
+/* Content codings served from precompressed files next to the originals,
+ * e.g. "app.js.br" for "app.js", in order of preference */
+static const struct {
+    const char* name;
+    const char* suffix;
+} encodings[] = {
+    { "br", ".br" },
+    { "zstd", ".zst" },
+    { "gzip", ".gz" },
+};
+#define ENCODINGS (int)(sizeof(encodings) / sizeof(encodings[0]))
+
+static const char*
+content_type(const char* path, size_t len)
+{
+    const char* dot = NULL;
+    for(const char* p = path + len; p > path && p[-1] != '/'; --p) {
+        if(p[-1] == '.') {
+            dot = p;
+            break;
+        }
+    }
+    if(dot) {
+        for(size_t i = 0; i < sizeof(content_types) / sizeof(content_types[0]); ++i) {
+            if(!strcasecmp(dot, content_types[i].extension))
+                return content_types[i].type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+/* IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"; not strftime(), whose
+ * names depend on the locale */
+static void
+format_http_date(char* buf, size_t size, time_t t)
+{
+    static const char days[7][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char months[12][4] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(buf, size, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+             days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900,
+             tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/* FNV-1a */
+static unsigned
+hash_path(const char* path, size_t len)
+{
+    unsigned hash = 2166136261u;
+    for(size_t i = 0; i < len; ++i)
+        hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+    return hash;
+}
+
+/* Whether `file` still describes what's at its path: the same regular
+ * file, or still none */
+static bool
+unchanged(StaticFile* file)
+{
+    struct stat st;
+    if(stat(file->path, &st) == -1 || !S_ISREG(st.st_mode))
+        return file->fd == -1;
+    return file->fd != -1
+           && st.st_dev == file->dev && st.st_ino == file->ino
+           && st.st_size == file->size
+           && st.st_mtim.tv_sec == file->mtime.tv_sec
+           && st.st_mtim.tv_nsec == file->mtime.tv_nsec;
+}
+
+static void
+lru_unlink(StaticCache* cache, StaticFile* file)
+{
+    if(file->lru_prev)
+        file->lru_prev->lru_next = file->lru_next;
+    else
+        cache->lru_head = file->lru_next;
+    if(file->lru_next)
+        file->lru_next->lru_prev = file->lru_prev;
+    else
+        cache->lru_tail = file->lru_prev;
+}
+
+static void
+lru_push_front(StaticCache* cache, StaticFile* file)
+{
+    file->lru_prev = NULL;
+    file->lru_next = cache->lru_head;
+    if(cache->lru_head)
+        cache->lru_head->lru_prev = file;
+    else
+        cache->lru_tail = file;
+    cache->lru_head = file;
+}
+
+/* Drop the cache's reference; responses still sending the file keep it open */
+static void
+cache_remove(StaticCache* cache, StaticFile* file)
+{
+    StaticFile** link = &cache->buckets[file->hash & (STATIC_CACHE_BUCKETS - 1)];
+    while(*link != file)
+        link = &(*link)->hash_next;
+    *link = file->hash_next;
+    lru_unlink(cache, file);
+    cache->count--;
+    StaticFile_release(file);
+}
+
+static StaticFile*
+new_file(const char* path, size_t len, unsigned hash)
+{
+    StaticFile* file = malloc(sizeof(StaticFile) + len + 1);
+    if(file == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    file->hash = hash;
+    file->refs = 1;
+    file->fd = -1;
+    file->path_len = len;
+    memcpy(file->path, path, len + 1);
+    return file;
+}
+
+/* Open the file at `file->path` and fill in its stat() results. Leaves `fd`
+ * at -1 if there's no regular file there. Returns false, with errno set, on
+ * errors that say nothing about the file, like running out of descriptors. */
+static bool
+open_file(StaticFile* file, ev_tstamp now)
+{
+    file->checked = now;
+    /* O_NONBLOCK: don't hang on FIFOs */
+    int fd = open(file->path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if(fd == -1)
+        return !(errno == ENOMEM || errno == EMFILE || errno == ENFILE);
+    struct stat st;
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return true;
+    }
+
+    file->fd = fd;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->size = st.st_size;
+    file->mtime = st.st_mtim;
+    file->content_type = content_type(file->path, file->path_len);
+    snprintf(file->etag, sizeof(file->etag), "\"%llx-%llx\"",
+             (unsigned long long)st.st_mtim.tv_sec, (unsigned long long)st.st_size);
+    format_http_date(file->last_modified, sizeof(file->last_modified), st.st_mtim.tv_sec);
+    return true;
+}
+
+/* Return a new reference to the file at `path` (with an `fd` of -1 if there
+ * is none), or NULL with errno set. Cached files are checked for changes
+ * every STATIC_CACHE_TTL seconds and reopened if they changed. */
+static StaticFile*
+cache_open(StaticCache* cache, const char* path, size_t len, ev_tstamp now)
+{
+    unsigned hash = hash_path(path, len);
+    StaticFile** bucket = &cache->buckets[hash & (STATIC_CACHE_BUCKETS - 1)];
+    StaticFile* file;
+
+    for(file = *bucket; file; file = file->hash_next) {
+        if(file->hash == hash && file->path_len == len && !memcmp(file->path, path, len))
+            break;
+    }
+    if(file) {
+        if(now - file->checked < STATIC_CACHE_TTL || unchanged(file)) {
+            if(now - file->checked >= STATIC_CACHE_TTL)
+                file->checked = now;
+            cache->hits++;
+            lru_unlink(cache, file);
+            lru_push_front(cache, file);
+            file->refs++;
+            return file;
+        }
+        cache->changed++;
+        cache_remove(cache, file);
+    }
+
+    cache->misses++;
+    if((file = new_file(path, len, hash)) == NULL)
+        return NULL;
+    if(!open_file(file, now)) {
+        int error = errno;
+        free(file);
+        errno = error;
+        return NULL;
+    }
+    file->hash_next = *bucket;
+    *bucket = file;
+    lru_push_front(cache, file);
+    if(++cache->count > STATIC_CACHE_MAX_FILES)
+        cache_remove(cache, cache->lru_tail);
+    file->refs++;
+    return file;
+}
+
+void StaticCache_init(StaticCache* cache)
+{
+    memset(cache, 0, sizeof(StaticCache));
+}
+
+void StaticCache_destroy(StaticCache* cache)
+{
+    while(cache->lru_head)
+        cache_remove(cache, cache->lru_head);
+}
+
+void StaticCache_print_stats(StaticCache* cache, FILE* out)
+{
+    fprintf(out, "static files: open=%zu hits=%lu misses=%lu changed=%lu\n",
+            cache->count, cache->hits, cache->misses, cache->changed);
+}
+
+void StaticFile_release(StaticFile* file)
+{
+    if(--file->refs == 0) {
+        if(file->fd != -1)
+            close(file->fd);
+        free(file);
+    }
+}
+
+/* Length of the path part of `url` */
+static size_t
+path_length(const char* url, size_t len)
+{
+    for(size_t i = 0; i < len; ++i) {
+        if(url[i] == '?' || url[i] == '#')
+            return i;
+    }
+    return len;
+}
+
+static const StaticRoute*
+find_route(ServerInfo* server_info, const char* path, size_t len)
+{
+    for(int i = 0; i < server_info->static_route_count; ++i) {
+        const StaticRoute* route = &server_info->static_routes[i];
+        if(len >= route->prefix_len && !memcmp(path, route->prefix, route->prefix_len)
+           && (len == route->prefix_len || path[route->prefix_len] == '/'))
+            return route;
+    }
+    return NULL;
+}
+
+/* True if the (raw) request URL is below one of the static routes */
+bool Static_match_url(ServerInfo* server_info, const char* url, size_t len)
+{
+    return find_route(server_info, url, path_length(url, len)) != NULL;
+}
+
+/* True if the unparsed `data` starts with the complete request line of a
+ * GET or HEAD request for a static route. The parser decides on the same
+ * URL, so such a request can be parsed without the GIL. */
+bool Static_request_line(ServerInfo* server_info, const char* data, size_t len)
+{
+    const char* url;
+    if(len > 4 && !memcmp(data, "GET ", 4))
+        url = data + 4;
+    else if(len > 5 && !memcmp(data, "HEAD ", 5))
+        url = data + 5;
+    else
+        return false;
+    const char* end = memchr(url, ' ', data + len - url);
+    return end != NULL && Static_match_url(server_info, url, end - url);
+}
+
+static bool
+has_dotdot_segment(const char* path, size_t len)
+{
+    const char* end = path + len;
+    for(const char* s = path; s < end; ) {
+        const char* e = memchr(s, '/', end - s);
+        if(e == NULL)
+            e = end;
+        if(e - s == 2 && s[0] == '.' && s[1] == '.')
+            return true;
+        s = e + 1;
+    }
+    return false;
+}
+
+/* Map the request URL to a file below its route's directory. Directories
+ * are served by their index.html. Returns NULL, or the status line of the
+ * error response. */
+static const char*
+map_path(Request* request, char* path, size_t* path_len)
+{
+    const char* url = request->parser.url_buf;
+    size_t url_len = path_length(url, request->parser.url_len);
+    const StaticRoute* route = find_route(request->server_info, url, url_len);
+    if(route == NULL)
+        return "404 Not Found";
+    const char* rest = url + route->prefix_len;
+    size_t rest_len = url_len - route->prefix_len;
+    if(route->root_len + rest_len + sizeof("/index.html") + STATIC_SUFFIX_MAX > PATH_MAX)
+        return "404 Not Found";
+
+    memcpy(path, route->root, route->root_len);
+    char* p = path + route->root_len;
+    memcpy(p, rest, rest_len);
+    if(rest_len && (rest_len = unquote_url_inplace(p, rest_len)) == 0)
+        return "400 Bad Request";
+    if(memchr(p, '\0', rest_len) || has_dotdot_segment(p, rest_len))
+        return "404 Not Found";
+    if(rest_len == 0 || p[rest_len - 1] == '/') {
+        const char* index = rest_len ? "index.html" : "/index.html";
+        memcpy(p + rest_len, index, strlen(index));
+        rest_len += strlen(index);
+    }
+    p[rest_len] = '\0';
+    *path_len = route->root_len + rest_len;
+    return NULL;
+}
+
+/* Value of a request header collected by the parser; NULL if it wasn't sent
+ * or can't be used */
+static const char*
+header_value(Request* request, int header, size_t* len)
+{
+    *len = request->static_value_lens[header];
+    if(*len == 0 || *len == STATIC_VALUE_UNUSABLE)
+        return NULL;
+    return request->static_scratch->values[header];
+}
+
+/* If-None-Match: a list of entity tags or "*", compared weakly */
+static bool
+etag_list_matches(const char* list, size_t len, const char* etag)
+{
+    size_t etag_len = strlen(etag);
+    const char* end = list + len;
+    const char* p = list;
+    while(p < end) {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        const char* start = p;
+        while(p < end && *p != ',')
+            ++p;
+        const char* stop = p;
+        while(stop > start && (stop[-1] == ' ' || stop[-1] == '\t'))
+            --stop;
+        if(stop - start == 1 && *start == '*')
+            return true;
+        if(stop - start > 2 && start[0] == 'W' && start[1] == '/')
+            start += 2;
+        if((size_t)(stop - start) == etag_len && !memcmp(start, etag, etag_len))
+            return true;
+    }
+    return false;
+}
+
+static bool
+not_modified(Request* request, StaticFile* file)
+{
+    const char* value;
+    size_t len;
+    if(request->static_value_lens[STATIC_IF_NONE_MATCH]) {
+        /* If-Modified-Since is ignored if there's an If-None-Match */
+        value = header_value(request, STATIC_IF_NONE_MATCH, &len);
+        return value != NULL && etag_list_matches(value, len, file->etag);
+    }
+    /* Clients send back the Last-Modified value we gave them */
+    value = header_value(request, STATIC_IF_MODIFIED_SINCE, &len);
+    return value != NULL && len == strlen(file->last_modified)
+           && !memcmp(value, file->last_modified, len);
+}
+
+/* True if the parameters of an Accept-Encoding list element say "q=0"
+ * (or "q=0.000"), i.e. "not acceptable" */
+static bool
+zero_qvalue(const char* p, const char* end)
+{
+    while((p = memchr(p, ';', end - p)) != NULL) {
+        ++p;
+        while(p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+        if(end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+            p += 2;
+            if(p == end || *p != '0')
+                return false;
+            for(++p; p < end && (*p == '0' || *p == '.'); ++p)
+                ;
+            return p == end || *p == ' ' || *p == '\t' || *p == ';';
+        }
+    }
+    return false;
+}
+
+/* The `encodings` the client accepts, as a bit mask of their indexes.
+ * Preference among them is ours; q values only matter if they're 0. */
+static int
+accepted_encodings(const char* value, size_t len)
+{
+    int accepted = 0, refused = 0;
+    bool any = false;
+    const char* end = value + len;
+    const char* p = value;
+    while(p < end) {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        const char* name = p;
+        while(p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            ++p;
+        size_t name_len = p - name;
+        const char* element_end = memchr(p, ',', end - p);
+        if(element_end == NULL)
+            element_end = end;
+        bool zero = zero_qvalue(p, element_end);
+        p = element_end;
+
+        if(name_len == 1 && *name == '*') {
+            /* Codings not listed otherwise */
+            any = any || !zero;
+            continue;
+        }
+        if(name_len == 6 && !strncasecmp(name, "x-gzip", 6)) {
+            name += 2;
+            name_len -= 2;
+        }
+        for(int i = 0; i < ENCODINGS; ++i) {
+            if(strlen(encodings[i].name) == name_len && !strncasecmp(name, encodings[i].name, name_len)) {
+                if(zero)
+                    refused |= 1 << i;
+                else
+                    accepted |= 1 << i;
+            }
+        }
+    }
+    if(any)
+        accepted = (1 << ENCODINGS) - 1;
+    return accepted & ~refused;
+}
+
+/* Look for precompressed versions of the file at `path`, which must have
+ * room for STATIC_SUFFIX_MAX more bytes. Ones older than the file (last
+ * modified at `mtime`) are stale and don't count. Returns a new reference
+ * to the most preferred one of the `accepted` encodings, if any; `vary`
+ * tells whether there are any at all. Without a `cache`, the files are
+ * opened for this response only. */
+static StaticFile*
+find_encoded(StaticCache* cache, char* path, size_t len, const struct timespec* mtime,
+             int accepted, ev_tstamp now, const char** encoding, bool* vary)
+{
+    StaticFile* found = NULL;
+    *vary = false;
+    for(int i = 0; i < ENCODINGS; ++i) {
+        size_t suffix_len = strlen(encodings[i].suffix);
+        memcpy(path + len, encodings[i].suffix, suffix_len + 1);
+        StaticFile* file;
+        if(cache) {
+            file = cache_open(cache, path, len + suffix_len, now);
+        } else if((file = new_file(path, len + suffix_len, 0)) != NULL) {
+            open_file(file, now);
+        }
+        if(file == NULL)
+            continue;
+        if(file->fd != -1
+           && (file->mtime.tv_sec > mtime->tv_sec
+               || (file->mtime.tv_sec == mtime->tv_sec && file->mtime.tv_nsec >= mtime->tv_nsec))) {
+            *vary = true;
+            if(found == NULL && (accepted & (1 << i))) {
+                found = file;
+                *encoding = encodings[i].name;
+                continue;
+            }
+        }
+        StaticFile_release(file);
+    }
+    path[len] = '\0';
+    return found;
+}
+
+/* For wsgi.file_wrapper responses: open the precompressed version of the
+ * file at `path`, last modified at `mtime`, that the client accepts
+ * according to `accept_encoding` (which may be NULL), if any. `vary` tells
+ * whether there are any at all. Not cached, the app threads can't use the
+ * event loops' caches. */
+StaticFile* Static_open_encoded(const char* path, size_t len, const struct timespec* mtime,
+                                const char* accept_encoding, size_t accept_len,
+                                const char** encoding, bool* vary)
+{
+    char buf[PATH_MAX];
+    *vary = false;
+    if(len + STATIC_SUFFIX_MAX >= PATH_MAX || memchr(path, '\0', len))
+        return NULL;
+    memcpy(buf, path, len);
+    buf[len] = '\0';
+    int accepted = accept_encoding ? accepted_encodings(accept_encoding, accept_len) : 0;
+    return find_encoded(NULL, buf, len, mtime, accepted, 0, encoding, vary);
+}
+
+/* Range requests are only answered for a single range, and (with If-Range)
+ * only if the client's copy is current. Anything else gets the whole file,
+ * which RFC 9110 allows. Returns the RANGE_* result. */
+static int
+requested_range(Request* request, StaticFile* file, byte_range* range)
+{
+    const char* value;
+    size_t len;
+    if(request->static_value_lens[STATIC_IF_RANGE]) {
+        value = header_value(request, STATIC_IF_RANGE, &len);
+        if(value == NULL
+           || !((len == strlen(file->etag) && !memcmp(value, file->etag, len))
+                || (len == strlen(file->last_modified) && !memcmp(value, file->last_modified, len))))
+            return RANGE_IGNORE;
+    }
+    value = header_value(request, STATIC_RANGE, &len);
+    if(value == NULL)
+        return RANGE_IGNORE;
+
+    byte_range ranges[MAX_RANGES];
+    int count;
+    int result = Range_parse(value, len, file->size, ranges, &count);
+    if(result == RANGE_OK && count > 1)
+        return RANGE_IGNORE;
+    *range = ranges[0];
+    return result;
+}
+
+/* Queue the response to the static file request that has been parsed. The
+ * headers are built in the Request's `static_scratch`, the file is sent with
+ * sendfile() like a wsgi.file_wrapper response. Returns false if not even
+ * an output queue could be allocated. */
+bool Static_prepare_response(StaticCache* cache, Request* request, ev_tstamp now)
+{
+    char path[PATH_MAX];
+    size_t path_len;
+    StaticFile* file = NULL;
+    bool head = request->parser.parser.method == HTTP_HEAD;
+    int len;
+
+    if(!Request_get_output(request))
+        return false;
+    request->state.keep_alive = llhttp_should_keep_alive(&request->parser.parser);
+    const char* connection = request->state.keep_alive ? "Keep-Alive" : "close";
+
+    const char* error = map_path(request, path, &path_len);
+    if(error == NULL) {
+        if((file = cache_open(cache, path, path_len, now)) == NULL) {
+            error = "503 Service Unavailable";
+        } else if(file->fd == -1) {
+            StaticFile_release(file);
+            error = "404 Not Found";
+        }
+    }
+    if(error) {
+        const char* body = error + strlen("404 ");
+        len = snprintf(request->static_scratch->head, STATIC_HEAD_SIZE,
+                       "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %zu"
+                       "\r\nConnection: %s\r\n\r\n%s",
+                       error, strlen(body), connection, head ? "" : body);
+        OutputQueue_push(request->output, request->static_scratch->head, len, NULL);
+        return true;
+    }
+
+    /* Send a precompressed version instead if the client accepts one. It has
+     * its own validators and ranges, but the original's Content-Type. */
+    const char* type = file->content_type;
+    const char* encoding = NULL;
+    bool vary;
+    size_t accept_len;
+    const char* accept = header_value(request, STATIC_ACCEPT_ENCODING, &accept_len);
+    StaticFile* encoded = find_encoded(cache, path, path_len, &file->mtime,
+                                       accept ? accepted_encodings(accept, accept_len) : 0,
+                                       now, &encoding, &vary);
+    if(encoded) {
+        StaticFile_release(file);
+        file = encoded;
+    }
+    const char* vary_header = vary ? "Vary: Accept-Encoding\r\n" : "";
+    char content_encoding[40] = "";
+    if(encoding)
+        snprintf(content_encoding, sizeof(content_encoding), "Content-Encoding: %s\r\n", encoding);
+
+    if(not_modified(request, file)) {
+        len = snprintf(request->static_scratch->head, STATIC_HEAD_SIZE,
+                       "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s"
+                       "\r\n%sConnection: %s\r\n\r\n",
+                       file->etag, file->last_modified, vary_header, connection);
+        OutputQueue_push(request->output, request->static_scratch->head, len, NULL);
+        StaticFile_release(file);
+        return true;
+    }
+
+    byte_range range = { 0, file->size };
+    char content_range[80] = "";
+    const char* status = "200 OK";
+    switch(head ? RANGE_IGNORE : requested_range(request, file, &range)) {
+    case RANGE_OK:
+        status = "206 Partial Content";
+        snprintf(content_range, sizeof(content_range), "Content-Range: bytes %lld-%lld/%lld\r\n",
+                 (long long)range.start, (long long)range.end - 1, (long long)file->size);
+        break;
+    case RANGE_UNSATISFIABLE:
+        len = snprintf(request->static_scratch->head, STATIC_HEAD_SIZE,
+                       "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld"
+                       "\r\nContent-Length: 0\r\n%sConnection: %s\r\n\r\n",
+                       (long long)file->size, vary_header, connection);
+        OutputQueue_push(request->output, request->static_scratch->head, len, NULL);
+        StaticFile_release(file);
+        return true;
+    default:
+        range.start = 0;
+        range.end = file->size;
+    }
+
+    len = snprintf(request->static_scratch->head, STATIC_HEAD_SIZE,
+                   "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %lld\r\n%s%s%s"
+                   "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes"
+                   "\r\nConnection: %s\r\n\r\n",
+                   status, type, (long long)(range.end - range.start),
+                   content_range, content_encoding, vary_header,
+                   file->etag, file->last_modified, connection);
+    OutputQueue_push(request->output, request->static_scratch->head, len, NULL);
+
+    if(head || range.start == range.end) {
+        StaticFile_release(file);
+        return true;
+    }
+    /* Sent as a range even if it's the whole file, so a file that grows
+     * meanwhile doesn't send more than Content-Length says */
+    request->static_file = file;
+    request->single_range = range;
+    request->ranges = &request->single_range;
+    request->range_count = 1;
+    request->file_offset = range.start;
+    return true;
+}
@@ -0,0 +1,92 @@
+#ifndef __static_h__
+#define __static_h__
+
+#include <ev.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include "server.h"
+
+/* Open files kept per event loop */
+#define STATIC_CACHE_MAX_FILES 1024
+#define STATIC_CACHE_BUCKETS (2 * STATIC_CACHE_MAX_FILES) /* power of two */
+/* Seconds a file's stat() results are trusted before it's checked for changes */
+#define STATIC_CACHE_TTL 1.0
+
+/* Request headers a static file response depends on */
+enum {
+    STATIC_IF_NONE_MATCH,
+    STATIC_IF_MODIFIED_SINCE,
+    STATIC_RANGE,
+    STATIC_IF_RANGE,
+    STATIC_ACCEPT_ENCODING,
+    STATIC_HEADERS
+};
+/* Longer (or repeated) values are ignored, which at worst costs a full
+ * (or uncompressed) response instead of a 304 or 206 */
+#define STATIC_VALUE_SIZE 64
+#define STATIC_VALUE_UNUSABLE 255
+/* Room for the response headers */
+#define STATIC_HEAD_SIZE 512
+/* Longest suffix of a precompressed file (".zst") */
+#define STATIC_SUFFIX_MAX 4
+
+/* Static file requests are handled without any Python objects: the request
+ * headers they depend on and the response headers go here. Only static
+ * requests have one, a buffer of the loop's BufferPool (see request.c). */
+typedef struct {
+    char values[STATIC_HEADERS][STATIC_VALUE_SIZE];
+    char head[STATIC_HEAD_SIZE];
+} StaticScratch;
+
+/* An open file with its stat() results and validators. Shared by the cache
+ * and the responses that are sending it; closed with the last reference.
+ * Paths without a regular file are cached too, with an `fd` of -1, so that
+ * looking for precompressed files doesn't cost any syscalls. */
+typedef struct StaticFile {
+    struct StaticFile* lru_prev;
+    struct StaticFile* lru_next;
+    struct StaticFile* hash_next;
+    unsigned hash;
+    int refs;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    ev_tstamp checked; /* time of the last stat() */
+    const char* content_type;
+    char etag[48];
+    char last_modified[32];
+    size_t path_len;
+    char path[];
+} StaticFile;
+
+/* Per-loop hash table of open files with LRU eviction. Only used by its
+ * loop's thread, so there's no locking. */
+typedef struct {
+    StaticFile* buckets[STATIC_CACHE_BUCKETS];
+    StaticFile* lru_head; /* most recently used */
+    StaticFile* lru_tail;
+    size_t count;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long changed; /* cached files found changed on disk */
+} StaticCache;
+
+struct _Request;
+
+void StaticCache_init(StaticCache*);
+void StaticCache_destroy(StaticCache*);
+void StaticCache_print_stats(StaticCache*, FILE*);
+void StaticFile_release(StaticFile*);
+
+bool Static_match_url(ServerInfo*, const char* url, size_t len);
+bool Static_request_line(ServerInfo*, const char* data, size_t len);
+bool Static_prepare_response(StaticCache*, struct _Request*, ev_tstamp now);
+StaticFile* Static_open_encoded(const char* path, size_t len, const struct timespec* mtime,
+                                const char* accept_encoding, size_t accept_len,
+                                const char** encoding, bool* vary);
+
+#endif
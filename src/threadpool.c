@@ -0,0 +1,91 @@
+#include <Python.h>
+#include "threadpool.h"
+
+static void*
+worker(void* arg)
+{
+    ThreadPool* pool = arg;
+    /* Keep a thread state for the lifetime of the thread, like the event
+     * loop threads do */
+    PyGILState_STATE gilstate = PyGILState_Ensure();
+
+    while(true) {
+        Request* request;
+
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&pool->lock);
+        while(pool->head == NULL && !pool->stopping)
+            pthread_cond_wait(&pool->wakeup, &pool->lock);
+        request = pool->head;
+        if(request) {
+            pool->head = request->app_next;
+            if(pool->head == NULL)
+                pool->tail = NULL;
+            request->app_next = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        Py_END_ALLOW_THREADS
+
+        if(request == NULL)
+            break;
+        pool->run(request);
+    }
+
+    PyGILState_Release(gilstate);
+    return NULL;
+}
+
+/* Start up to `count` threads; returns how many are running */
+int ThreadPool_start(ThreadPool* pool, int count, void (*run)(Request*))
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pool->head = pool->tail = NULL;
+    pool->stopping = false;
+    pool->run = run;
+    pool->count = 0;
+    pool->threads = calloc(count, sizeof(pthread_t));
+    if(pool->threads == NULL)
+        return 0;
+
+    for(int i = 0; i < count; ++i) {
+        int err = pthread_create(&pool->threads[pool->count], NULL, worker, pool);
+        if(err) {
+            fprintf(stderr, "Could not start app thread %d: %s\n", i, strerror(err));
+            break;
+        }
+        pool->count++;
+    }
+    return pool->count;
+}
+
+void ThreadPool_submit(ThreadPool* pool, Request* request)
+{
+    pthread_mutex_lock(&pool->lock);
+    request->app_next = NULL;
+    if(pool->tail)
+        pool->tail->app_next = request;
+    else
+        pool->head = request;
+    pool->tail = request;
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Let the threads finish the queued calls and wait for them to exit. Must be
+ * called without holding the GIL. */
+void ThreadPool_stop(ThreadPool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->count; ++i)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->count = 0;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wakeup);
+}
@@ -0,0 +1,26 @@
+#ifndef __threadpool_h__
+#define __threadpool_h__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "request.h"
+
+/* Threads that call the application on behalf of the event loops, so that a
+ * slow app call doesn't hold up the loop's other connections. Requests are
+ * queued through their `app_next` link and served in order. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    Request* head;
+    Request* tail;
+    bool stopping;
+    pthread_t* threads;
+    int count; /* threads running, 0 = the loops call the app themselves */
+    void (*run)(Request*); /* called in a pool thread with the GIL held */
+} ThreadPool;
+
+int ThreadPool_start(ThreadPool*, int count, void (*run)(Request*));
+void ThreadPool_submit(ThreadPool*, Request*);
+void ThreadPool_stop(ThreadPool*);
+
+#endif
@@ -0,0 +1,96 @@
+#include "timeout.h"
+
+void Timeouts_init(Timeouts* timeouts, struct ev_loop* loop,
+                   void (*callback)(struct ev_loop*, ev_timer*, int))
+{
+    for(int i = 0; i < TIMEOUT_KINDS; ++i) {
+        timeouts->lists[i].prev = timeouts->lists[i].next = &timeouts->lists[i];
+        timeouts->durations[i] = 0;
+        timeouts->expired[i] = 0;
+    }
+    timeouts->loop = loop;
+    timeouts->timer_at = 0;
+    ev_timer_init(&timeouts->timer, callback, 0., 0.);
+}
+
+void Timeouts_clear(timeout_entry* entry)
+{
+    if(entry->kind == -1)
+        return;
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->kind = -1;
+}
+
+/* The timer is unref'd: open connections keep the loop alive, not their
+ * timeouts. It has to be ref'd again before it's stopped. */
+static void
+stop_timer(Timeouts* timeouts)
+{
+    if(ev_is_active(&timeouts->timer)) {
+        ev_ref(timeouts->loop);
+        ev_timer_stop(timeouts->loop, &timeouts->timer);
+    }
+}
+
+static void
+arm(Timeouts* timeouts, ev_tstamp deadline)
+{
+    ev_tstamp after = deadline - ev_now(timeouts->loop);
+    timeouts->timer_at = deadline;
+    stop_timer(timeouts);
+    ev_timer_set(&timeouts->timer, after > 0 ? after : 0., 0.);
+    ev_timer_start(timeouts->loop, &timeouts->timer);
+    ev_unref(timeouts->loop);
+}
+
+/* (Re)start the `kind` timeout for `entry`, replacing any other */
+void Timeouts_set(Timeouts* timeouts, timeout_entry* entry, int kind)
+{
+    Timeouts_clear(entry);
+    if(timeouts->durations[kind] == 0)
+        return;
+
+    timeout_entry* head = &timeouts->lists[kind];
+    entry->deadline = ev_now(timeouts->loop) + timeouts->durations[kind];
+    entry->kind = kind;
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+
+    if(!ev_is_active(&timeouts->timer) || entry->deadline < timeouts->timer_at)
+        arm(timeouts, entry->deadline);
+}
+
+/* Unlink and return an entry whose deadline has passed, or NULL */
+timeout_entry* Timeouts_pop_expired(Timeouts* timeouts)
+{
+    ev_tstamp now = ev_now(timeouts->loop);
+    for(int i = 0; i < TIMEOUT_KINDS; ++i) {
+        timeout_entry* entry = timeouts->lists[i].next;
+        if(entry != &timeouts->lists[i] && entry->deadline <= now) {
+            Timeouts_clear(entry);
+            timeouts->expired[i]++;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Start the timer for the earliest deadline, if any. To be called from the
+ * timer's callback. */
+void Timeouts_rearm(Timeouts* timeouts)
+{
+    /* libev has stopped the expired timer, which undid our ev_unref() */
+    ev_ref(timeouts->loop);
+
+    ev_tstamp next = 0;
+    for(int i = 0; i < TIMEOUT_KINDS; ++i) {
+        timeout_entry* entry = timeouts->lists[i].next;
+        if(entry != &timeouts->lists[i] && (next == 0 || entry->deadline < next))
+            next = entry->deadline;
+    }
+    if(next)
+        arm(timeouts, next);
+}
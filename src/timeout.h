@@ -0,0 +1,46 @@
+#ifndef __timeout_h__
+#define __timeout_h__
+
+#include <ev.h>
+#include <stdbool.h>
+
+enum {
+    TIMEOUT_READ,      /* new connection, waiting for the first request */
+    TIMEOUT_HEADER,    /* receiving the request headers */
+    TIMEOUT_BODY,      /* receiving the request body */
+    TIMEOUT_WRITE,     /* waiting for the client to take response data */
+    TIMEOUT_KEEPALIVE, /* idle between requests */
+    TIMEOUT_KINDS
+};
+
+/* Intrusive link; embedded in every connection's Request */
+typedef struct timeout_entry {
+    struct timeout_entry* prev;
+    struct timeout_entry* next;
+    ev_tstamp deadline;
+    int kind; /* -1 if not linked */
+} timeout_entry;
+
+/* Connection timeouts of one loop. There's a list per kind of timeout, and
+ * since all entries of a list have the same duration and are appended when
+ * (re)armed, each list is sorted by deadline. A single ev_timer for the
+ * earliest list head is enough, and arming, refreshing and cancelling a
+ * timeout are O(1). */
+typedef struct {
+    timeout_entry lists[TIMEOUT_KINDS]; /* list heads */
+    ev_tstamp durations[TIMEOUT_KINDS]; /* 0 = no timeout */
+    unsigned long expired[TIMEOUT_KINDS];
+    struct ev_loop* loop;
+    ev_timer timer;
+    ev_tstamp timer_at;
+} Timeouts;
+
+void Timeouts_init(Timeouts*, struct ev_loop*, void (*callback)(struct ev_loop*, ev_timer*, int));
+void Timeouts_set(Timeouts*, timeout_entry*, int kind);
+void Timeouts_clear(timeout_entry*);
+timeout_entry* Timeouts_pop_expired(Timeouts*);
+void Timeouts_rearm(Timeouts*);
+
+#define Timeouts_ENTRY_INIT(entry) ((entry)->kind = -1)
+
+#endif
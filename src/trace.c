@@ -0,0 +1,51 @@
+#include "trace.h"
+
+#ifdef WANT_TRACING
+
+static const char* phase_names[TRACE_PHASES] = {
+    "parse",
+    "wsgi_call",
+    "write"
+};
+
+void trace_add(trace_stats* stats, trace_phase phase, uint64_t ns)
+{
+    trace_histogram* h = &stats->phases[phase];
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    while(us && bucket < TRACE_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    h->count++;
+    h->total_ns += ns;
+    if(ns > h->max_ns)
+        h->max_ns = ns;
+    h->buckets[bucket]++;
+}
+
+void trace_print(trace_stats* stats, FILE* out)
+{
+    for(int phase = 0; phase < TRACE_PHASES; phase++) {
+        trace_histogram* h = &stats->phases[phase];
+        fprintf(out, "%s: count=%lu avg=%.1fus max=%.1fus\n", phase_names[phase],
+                h->count, h->count ? h->total_ns / 1000.0 / h->count : 0.0,
+                h->max_ns / 1000.0);
+        for(int i = 0; i < TRACE_BUCKETS; i++) {
+            if(!h->buckets[i])
+                continue;
+            if(i == 0)
+                fprintf(out, "  <1us: %lu\n", h->buckets[i]);
+            else if(i == 1)
+                fprintf(out, "  1us: %lu\n", h->buckets[i]);
+            else if(i == TRACE_BUCKETS - 1)
+                fprintf(out, "  >=%luus: %lu\n", 1UL << (i - 1), h->buckets[i]);
+            else
+                fprintf(out, "  %lu-%luus: %lu\n", 1UL << (i - 1), (1UL << i) - 1, h->buckets[i]);
+        }
+    }
+}
+
+#endif
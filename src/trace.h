@@ -0,0 +1,57 @@
+#ifndef __trace_h__
+#define __trace_h__
+
+/* Optional per-phase latency tracing, compiled in with -D WANT_TRACING
+ * (`make WANT_TRACING=yes`). Without it all trace points are no-ops. */
+
+#ifdef WANT_TRACING
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef enum {
+    TRACE_PARSE,     /* one Request_parse() call */
+    TRACE_WSGI_CALL, /* wsgi_call_application() */
+    TRACE_WRITE,     /* first write attempt until the response is sent */
+    TRACE_PHASES
+} trace_phase;
+
+/* Bucket i counts latencies in [2^(i-1), 2^i) microseconds;
+ * the last bucket also takes everything above. */
+#define TRACE_BUCKETS 24
+
+typedef struct {
+    unsigned long count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    unsigned long buckets[TRACE_BUCKETS];
+} trace_histogram;
+
+typedef struct {
+    trace_histogram phases[TRACE_PHASES];
+} trace_stats;
+
+static inline uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_add(trace_stats*, trace_phase, uint64_t ns);
+void trace_print(trace_stats*, FILE*);
+
+#define TRACE_START(var) uint64_t var = trace_now()
+#define TRACE_SET(lvalue) (lvalue) = trace_now()
+#define TRACE_END(stats, phase, var) trace_add(stats, phase, trace_now() - (var))
+
+#else
+
+#define TRACE_START(var) do{}while(0)
+#define TRACE_SET(lvalue) do{}while(0)
+#define TRACE_END(stats, phase, var) do{}while(0)
+
+#endif
+
+#endif
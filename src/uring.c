@@ -0,0 +1,222 @@
+#ifdef WANT_IO_URING
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* True if the kernel knows all the operations we use */
+static bool
+probe_ops(int fd)
+{
+    static const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_ASYNC_CANCEL };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    bool ok = probe && io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for(size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); ++i) {
+        ok = needed[i] <= probe->last_op
+             && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static bool
+setup_buffers(Uring* ring, unsigned buf_count, size_t buf_size)
+{
+    ring->buf_count = buf_count;
+    ring->buf_size = buf_size;
+    ring->buf_tail = 0;
+    ring->buf_ring_size = buf_count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if(io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return false;
+
+    ring->bufs = calloc(buf_count, sizeof(char*));
+    if(ring->bufs == NULL)
+        return false;
+    for(unsigned i = 0; i < buf_count; ++i) {
+        if((ring->bufs[i] = malloc(buf_size)) == NULL)
+            return false;
+        Uring_put_buffer(ring, (unsigned short)i);
+    }
+    return true;
+}
+
+/* Returns false (with errno set) if io_uring isn't available or too old */
+bool Uring_init(Uring* ring, unsigned entries, unsigned buf_count, size_t buf_size)
+{
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = io_uring_setup(entries, &params);
+    if(ring->fd == -1)
+        return false;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !probe_ops(ring->fd)) {
+        errno = ENOSYS;
+        goto error;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->ring_mem == MAP_FAILED) {
+        ring->ring_mem = NULL;
+        goto error;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    char* mem = ring->ring_mem;
+    ring->sq_head = (unsigned*)(mem + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(mem + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(mem + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    /* SQEs are used in ring order, so the index array is the identity */
+    unsigned* sq_array = (unsigned*)(mem + params.sq_off.array);
+    for(unsigned i = 0; i < params.sq_entries; ++i)
+        sq_array[i] = i;
+    ring->cq_head = (unsigned*)(mem + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(mem + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(mem + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(mem + params.cq_off.cqes);
+
+    if(!setup_buffers(ring, buf_count, buf_size))
+        goto error;
+    return true;
+
+error:
+    {
+        int saved_errno = errno;
+        Uring_destroy(ring);
+        errno = saved_errno;
+    }
+    return false;
+}
+
+void Uring_destroy(Uring* ring)
+{
+    if(ring->fd != -1)
+        close(ring->fd);
+    if(ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->ring_mem)
+        munmap(ring->ring_mem, ring->ring_size);
+    if(ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    if(ring->bufs) {
+        for(unsigned i = 0; i < ring->buf_count; ++i)
+            free(ring->bufs[i]);
+        free(ring->bufs);
+    }
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = -1;
+}
+
+/* A zeroed SQE to fill in; it's submitted with the next Uring_submit().
+ * Returns NULL if the submission queue is full and can't be flushed. */
+struct io_uring_sqe* Uring_get_sqe(Uring* ring)
+{
+    if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        Uring_submit(ring);
+        if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/* Hand the prepared SQEs to the kernel; one syscall for all of them */
+int Uring_submit(Uring* ring)
+{
+    unsigned pending = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if(pending == 0)
+        return 0;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    int submitted;
+    do {
+        submitted = io_uring_enter(ring->fd, pending, 0, 0);
+    } while(submitted == -1 && errno == EINTR);
+    ring->enters++;
+    return submitted;
+}
+
+/* The next completion, or NULL. Uring_cqe_seen() releases it. */
+struct io_uring_cqe* Uring_peek_cqe(Uring* ring)
+{
+    unsigned head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void Uring_cqe_seen(Uring* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+    ring->completions++;
+}
+
+/* Give a receive buffer back to the kernel */
+void Uring_put_buffer(Uring* ring, unsigned short bid)
+{
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)Uring_BUFFER(ring, bid);
+    buf->len = (uint32_t)ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* The caller keeps receive buffer `bid` with its data; the kernel gets
+ * `buf` (of the same size) in its place */
+void Uring_swap_buffer(Uring* ring, unsigned short bid, char* buf)
+{
+    ring->bufs[bid] = buf;
+    Uring_put_buffer(ring, bid);
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __uring_h__
+#define __uring_h__
+
+#ifdef WANT_IO_URING
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/* Provided buffers are registered as buffer group 0 */
+#define URING_BUFFER_GROUP 0
+
+/* Bare io_uring instance (no liburing): submission and completion rings
+ * plus a ring of receive buffers the kernel picks from when a recv
+ * completes, so that connections waiting for data don't hold a buffer.
+ * Needs Linux 5.19 for the buffer ring and multishot accept. */
+typedef struct {
+    int fd;
+    void* ring_mem;
+    size_t ring_size;
+    /* submission queue */
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; /* SQEs prepared, published by Uring_submit */
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    /* completion queue */
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    /* provided receive buffers */
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    char** bufs;        /* by buffer ID, see Uring_swap_buffer() */
+    unsigned buf_count; /* power of two */
+    size_t buf_size;
+    unsigned short buf_tail;
+    /* statistics */
+    unsigned long enters;
+    unsigned long completions;
+} Uring;
+
+bool Uring_init(Uring*, unsigned entries, unsigned buf_count, size_t buf_size);
+void Uring_destroy(Uring*);
+struct io_uring_sqe* Uring_get_sqe(Uring*);
+int Uring_submit(Uring*);
+struct io_uring_cqe* Uring_peek_cqe(Uring*);
+void Uring_cqe_seen(Uring*);
+void Uring_put_buffer(Uring*, unsigned short bid);
+void Uring_swap_buffer(Uring*, unsigned short bid, char* buf);
+
+#define Uring_BUFFER(ring, bid) ((ring)->bufs[bid])
+
+#endif
+
+#endif
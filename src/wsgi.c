@@ -1,9 +1,17 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include "common.h"
 #include "filewrapper.h"
+#include "input.h"
 #include "wsgi.h"
 #include "py2py3.h"
 
 static void wsgi_getheaders(Request*, PyObject** buf, Py_ssize_t* length);
+static bool prepare_file_response(Request*, PyObject* environ);
+static int collect_chunks(Request*, PyObject* first_chunk, PyObject** chunks, int max_chunks);
+static void queue_chunks(Request*, PyObject** chunks, int n);
 
 typedef struct {
     PyObject_HEAD
@@ -29,11 +37,12 @@ wsgi_call_application(Request* request)
                            NULL /* sentinel */
                        );
 
-    Py_DECREF(request_headers);
     Py_DECREF(start_response);
 
-    if(retval == NULL)
+    if(retval == NULL) {
+        Py_DECREF(request_headers);
         return false;
+    }
 
     /* The following code is somewhat magic, so worth an explanation.
      *
@@ -93,11 +102,15 @@ bytestring:
         /* Generic iterable (list of length != 1, generator, ...) */
         request->iterable = retval;
         request->iterator = PyObject_GetIter(retval);
-        if(request->iterator == NULL)
+        if(request->iterator == NULL) {
+            Py_DECREF(request_headers);
             return false;
+        }
         first_chunk = wsgi_iterable_get_next_chunk(request);
-        if(first_chunk == NULL && PyErr_Occurred())
+        if(first_chunk == NULL && PyErr_Occurred()) {
+            Py_DECREF(request_headers);
             return false;
+        }
     }
 
     if(request->headers == NULL) {
@@ -110,9 +123,18 @@ bytestring:
             "wsgi application returned before start_response was called"
         );
         Py_XDECREF(first_chunk);
+        Py_DECREF(request_headers);
         return false;
     }
 
+    /* The request headers are needed once more, for Range requests */
+    bool file_response = request->iterable != NULL && request->iterator == NULL;
+    if(file_response && !prepare_file_response(request, request_headers)) {
+        Py_DECREF(request_headers);
+        return false;
+    }
+    Py_DECREF(request_headers);
+
     /* Special-case HTTP 204 and 304 */
     if (!strncmp(_PEP3333_Bytes_AS_DATA(request->status), "204", 3) ||
         !strncmp(_PEP3333_Bytes_AS_DATA(request->status), "304", 3)) {
@@ -122,7 +144,11 @@ bytestring:
     /* keep-alive cruft */
     if(llhttp_should_keep_alive(&request->parser.parser)) {
         if(request->state.response_length_unknown) {
-            if(request->parser.parser.http_major > 0 && request->parser.parser.http_minor > 0) {
+            if(file_response) {
+                /* fstat() failed in prepare_file_response(); sendfile()
+                 * can't do chunked framing, so close the connection. */
+                request->state.keep_alive = false;
+            } else if(request->parser.parser.http_major > 0 && request->parser.parser.http_minor > 0) {
                 /* On HTTP 1.1, we can use Transfer-Encoding: chunked. */
                 request->state.chunked_response = true;
                 request->state.keep_alive = true;
@@ -139,37 +165,67 @@ bytestring:
         request->state.keep_alive = false;
     }
 
-    /* Get the headers and concatenate the first body chunk.
-     * In the first place this makes the code more simple because afterwards
-     * we can throw away the first chunk PyObject; but it also is an optimization:
-     * At least for small responses, the complete response could be sent with
-     * one send() call (in server.c:ev_io_on_write) which is a (tiny) performance
-     * booster because less kernel calls means less kernel call overhead. */
-    Py_ssize_t length;
-    PyObject* buf;
-    wsgi_getheaders(request, &buf, &length);
+    /* Queue the headers, the first body chunk and whatever else the iterator
+     * yields within the write budget. All of that is sent with the same
+     * writev() call (in server.c:write_response), so at least for small
+     * responses the complete response goes out with one kernel call -- and
+     * unlike concatenating them, the body chunks don't have to be copied.
+     * The output queue may still hold the responses to earlier pipelined
+     * requests, so nothing is queued before we know the iterator didn't fail. */
+    if(!Request_get_output(request)) {
+        Py_XDECREF(first_chunk);
+        PyErr_NoMemory();
+        return false;
+    }
+
+    request->state.wsgi_call_done = true;
+
+    PyObject* chunks[OUTPUT_QUEUE_SIZE];
+    int n = 0;
+    /* A 416 drops the file */
+    file_response = file_response && request->iterable != NULL;
+    if(!file_response) {
+        /* headers + chunk framing + terminator */
+        n = collect_chunks(request, first_chunk, chunks, OutputQueue_space(request->output) - 4);
+        if(n == -1)
+            return false;
+    }
 
-    if(first_chunk == NULL) {
-        _PEP3333_Bytes_Resize(&buf, length);
-        goto out;
+    if(!request->state.parse_finished && request->iterator) {
+        /* Early dispatch: the rest of the iterator runs in the event loop,
+         * which can't wait for the client, so have the body buffered in
+         * case it reads wsgi.input. This is still the app thread. */
+        if(Input_ReadAll(request->body) == -1) {
+            while(n)
+                Py_DECREF(chunks[--n]);
+            return false;
+        }
     }
 
-    if(request->state.chunked_response) {
-        PyObject* new_chunk = wrap_http_chunk_cruft_around(first_chunk);
-        Py_DECREF(first_chunk);
-        assert(_PEP3333_Bytes_GET_SIZE(new_chunk) >= _PEP3333_Bytes_GET_SIZE(first_chunk) + 5);
-        first_chunk = new_chunk;
+    if(!request->state.parse_finished) {
+        /* Early dispatch and the application didn't read the whole request
+         * body: the rest of it is still in the socket, so we can't reuse it.
+         * Nothing that runs in the event loop from now on (the iterable's
+         * close()) may wait for it. */
+        request->state.keep_alive = false;
+        Input_SetSource(request->body, NULL, NULL);
     }
 
-    _PEP3333_Bytes_Resize(&buf, length + _PEP3333_Bytes_GET_SIZE(first_chunk));
-    memcpy((void*)(_PEP3333_Bytes_AS_DATA(buf) + length), _PEP3333_Bytes_AS_DATA(first_chunk),
-           _PEP3333_Bytes_GET_SIZE(first_chunk));
-    Py_DECREF(first_chunk);
+    Py_ssize_t length;
+    PyObject* buf;
+    wsgi_getheaders(request, &buf, &length);
+    OutputQueue_push(request->output, _PEP3333_Bytes_AS_DATA(buf), length, buf);
+
+    if(request->range_heads) {
+        /* multipart/byteranges: the first part's header */
+        PyObject* head = PyList_GET_ITEM(request->range_heads, 0);
+        Py_INCREF(head);
+        OutputQueue_push(request->output, _PEP3333_Bytes_AS_DATA(head),
+                         _PEP3333_Bytes_GET_SIZE(head), head);
+    }
 
-out:
-    request->state.wsgi_call_done = true;
-    request->current_chunk = buf;
-    request->current_chunk_p = 0;
+    if(!file_response)
+        queue_chunks(request, chunks, n);
     return true;
 }
 
@@ -220,10 +276,395 @@ err:
 }
 
 
+/* Value of a response header (borrowed), or NULL if the app didn't set it */
+static PyObject*
+find_header(Request* request, const char* name)
+{
+    Py_ssize_t len = strlen(name);
+    for(Py_ssize_t i = 0; i < PyList_GET_SIZE(request->headers); ++i) {
+        PyObject* tuple = PyList_GET_ITEM(request->headers, i);
+        PyObject* field = PyTuple_GET_ITEM(tuple, 0);
+        if(_PEP3333_Bytes_GET_SIZE(field) == len
+           && !strncasecmp(_PEP3333_Bytes_AS_DATA(field), name, len))
+            return PyTuple_GET_ITEM(tuple, 1);
+    }
+    return NULL;
+}
+
+/* vsnprintf() into a new bytes object */
+static PyObject*
+bytes_printf(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    PyObject* bytes = _PEP3333_Bytes_FromStringAndSize(NULL, len);
+    if(bytes == NULL)
+        return NULL;
+    va_start(args, format);
+    vsnprintf((char*)_PEP3333_Bytes_AS_DATA(bytes), len + 1, format, args);
+    va_end(args);
+    return bytes;
+}
+
+/* Append a (field, value) tuple to `headers`; steals `value` */
+static bool
+append_header(PyObject* headers, const char* field, PyObject* value)
+{
+    if(value == NULL)
+        return false;
+    PyObject* field_bytes = _PEP3333_Bytes_FromString(field);
+    PyObject* tuple = field_bytes ? PyTuple_Pack(2, field_bytes, value) : NULL;
+    Py_XDECREF(field_bytes);
+    Py_DECREF(value);
+    if(tuple == NULL)
+        return false;
+    int err = PyList_Append(headers, tuple);
+    Py_DECREF(tuple);
+    return err == 0;
+}
+
+/* Replace the app's status (unless `status` is NULL) and headers. The header
+ * list is copied without Content-Length (and Content-Type, if
+ * `drop_content_type`); we may not change the app's own list, it might reuse
+ * it for other responses. */
+static PyObject*
+replace_response(Request* request, const char* status, bool drop_content_type)
+{
+    PyObject* headers = PyList_New(0);
+    if(headers == NULL)
+        return NULL;
+    for(Py_ssize_t i = 0; i < PyList_GET_SIZE(request->headers); ++i) {
+        PyObject* tuple = PyList_GET_ITEM(request->headers, i);
+        PyObject* field = PyTuple_GET_ITEM(tuple, 0);
+        const char* name = _PEP3333_Bytes_AS_DATA(field);
+        if(!strcasecmp(name, "Content-Length")
+           || (drop_content_type && !strcasecmp(name, "Content-Type")))
+            continue;
+        if(PyList_Append(headers, tuple) == -1) {
+            Py_DECREF(headers);
+            return NULL;
+        }
+    }
+    if(status != NULL) {
+        PyObject* status_bytes = _PEP3333_Bytes_FromString(status);
+        if(status_bytes == NULL) {
+            Py_DECREF(headers);
+            return NULL;
+        }
+        Py_DECREF(request->status);
+        request->status = status_bytes;
+    }
+    Py_DECREF(request->headers);
+    request->headers = headers;
+    return headers;
+}
+
+/* If-Range: send the ranges only if the client's validator matches the
+ * response's strong ETag, or its Last-Modified date exactly. */
+static bool
+if_range_matches(Request* request, PyObject* if_range)
+{
+    const char* value = _PEP3333_Bytes_AS_DATA(if_range);
+    PyObject* validator = find_header(request, value[0] == '"' ? "ETag" : "Last-Modified");
+    return validator != NULL
+           && _PEP3333_Bytes_GET_SIZE(validator) == _PEP3333_Bytes_GET_SIZE(if_range)
+           && !memcmp(_PEP3333_Bytes_AS_DATA(validator), value, _PEP3333_Bytes_GET_SIZE(if_range));
+}
+
+static bool
+setup_single_range(Request* request, byte_range* range, off_t size)
+{
+    PyObject* headers = replace_response(request, "206 Partial Content", false);
+    if(headers == NULL
+       || !append_header(headers, "Content-Range",
+                         bytes_printf("bytes %lld-%lld/%lld", (long long)range->start,
+                                      (long long)range->end - 1, (long long)size))
+       || !append_header(headers, "Content-Length",
+                         bytes_printf("%lld", (long long)(range->end - range->start))))
+        return false;
+    request->single_range = *range;
+    request->ranges = &request->single_range;
+    request->range_count = 1;
+    return true;
+}
+
+/* Several ranges are sent as multipart/byteranges. The part headers are
+ * queued between the sendfile() runs, so the file data still isn't copied. */
+static bool
+setup_multiple_ranges(Request* request, byte_range* ranges, int count,
+                      off_t size, struct stat* st)
+{
+    static unsigned long boundary_counter;
+    char boundary[40];
+    snprintf(boundary, sizeof(boundary), "%08lx%016llx",
+             __atomic_add_fetch(&boundary_counter, 1, __ATOMIC_RELAXED),
+             (unsigned long long)st->st_mtime ^ ((unsigned long long)st->st_ino << 32));
+
+    PyObject* content_type = find_header(request, "Content-Type");
+    Py_XINCREF(content_type); /* the header list is replaced below */
+
+    PyObject* heads = PyList_New(count + 1);
+    request->ranges = malloc((count + 1) * sizeof(byte_range));
+    if(heads == NULL || request->ranges == NULL)
+        goto error;
+    request->range_heads = heads;
+
+    off_t length = 0;
+    for(int i = 0; i < count; ++i) {
+        PyObject* head = bytes_printf(
+            "\r\n--%s%s%s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+            boundary,
+            content_type ? "\r\nContent-Type: " : "",
+            content_type ? _PEP3333_Bytes_AS_DATA(content_type) : "",
+            (long long)ranges[i].start, (long long)ranges[i].end - 1, (long long)size);
+        if(head == NULL)
+            goto error;
+        PyList_SET_ITEM(heads, i, head);
+        request->ranges[i] = ranges[i];
+        length += _PEP3333_Bytes_GET_SIZE(head) + (ranges[i].end - ranges[i].start);
+    }
+    PyObject* tail = bytes_printf("\r\n--%s--\r\n", boundary);
+    if(tail == NULL)
+        goto error;
+    PyList_SET_ITEM(heads, count, tail);
+    request->ranges[count].start = request->ranges[count].end = ranges[count - 1].end;
+    length += _PEP3333_Bytes_GET_SIZE(tail);
+    request->range_count = count + 1;
+    Py_CLEAR(content_type);
+
+    PyObject* headers = replace_response(request, "206 Partial Content", true);
+    return headers != NULL
+           && append_header(headers, "Content-Type",
+                            bytes_printf("multipart/byteranges; boundary=%s", boundary))
+           && append_header(headers, "Content-Length", bytes_printf("%lld", (long long)length));
+
+error:
+    if(!PyErr_Occurred())
+        PyErr_NoMemory();
+    Py_XDECREF(content_type);
+    if(request->range_heads == NULL)
+        Py_XDECREF(heads);
+    return false;
+}
+
+/* Answer a Range request for a file: 206 with the requested part(s) of it,
+ * or 416 if none of them exists. `start` and `size` describe the part of the
+ * file that makes up the response. Returns 1 if the response was changed, 0
+ * if the whole file is to be sent (including range sets we can't make sense
+ * of), -1 with an exception set on errors. */
+static int
+prepare_range_response(Request* request, PyObject* environ,
+                       off_t start, off_t size, struct stat* st)
+{
+    PyObject* range = PyDict_GetItem(environ, _HTTP_RANGE);
+    if(range == NULL)
+        return 0;
+    range = _PEP3333_BytesLatin1_FromUnicode(range);
+    if(range == NULL)
+        return -1;
+
+    PyObject* if_range = PyDict_GetItem(environ, _HTTP_IF_RANGE);
+    if(if_range != NULL) {
+        if_range = _PEP3333_BytesLatin1_FromUnicode(if_range);
+        if(if_range == NULL) {
+            Py_DECREF(range);
+            return -1;
+        }
+        bool matches = if_range_matches(request, if_range);
+        Py_DECREF(if_range);
+        if(!matches) {
+            Py_DECREF(range);
+            return 0;
+        }
+    }
+
+    byte_range ranges[MAX_RANGES];
+    int count;
+    int result = Range_parse(_PEP3333_Bytes_AS_DATA(range), _PEP3333_Bytes_GET_SIZE(range),
+                             size, ranges, &count);
+    Py_DECREF(range);
+
+    switch(result) {
+    case RANGE_OK:
+        if(count == 1 && !setup_single_range(request, &ranges[0], size))
+            return -1;
+        if(count > 1 && !setup_multiple_ranges(request, ranges, count, size, st))
+            return -1;
+        /* The ranges are relative to `start` */
+        for(int i = 0; i < request->range_count; ++i) {
+            request->ranges[i].start += start;
+            request->ranges[i].end += start;
+        }
+        request->file_offset = request->ranges[0].start;
+        return 1;
+    case RANGE_UNSATISFIABLE:
+    {
+        PyObject* headers = replace_response(request, "416 Range Not Satisfiable", false);
+        if(headers == NULL
+           || !append_header(headers, "Content-Range",
+                             bytes_printf("bytes */%lld", (long long)size))
+           || !append_header(headers, "Content-Length", bytes_printf("0")))
+            return -1;
+        /* No body; drop the file */
+        FileWrapper_Done(request->iterable);
+        Py_CLEAR(request->iterable);
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+/* The app's ETag describes the file itself; a precompressed version gets
+ * its own, e.g. "abc" -> "abc-br". ETags we can't make sense of are
+ * dropped, rather than shared by both. */
+static bool
+encode_etag(PyObject* headers, const char* encoding)
+{
+    for(Py_ssize_t i = 0; i < PyList_GET_SIZE(headers); ++i) {
+        PyObject* tuple = PyList_GET_ITEM(headers, i);
+        PyObject* field = PyTuple_GET_ITEM(tuple, 0);
+        PyObject* value = PyTuple_GET_ITEM(tuple, 1);
+        Py_ssize_t len = _PEP3333_Bytes_GET_SIZE(value);
+        if(strcasecmp(_PEP3333_Bytes_AS_DATA(field), "ETag"))
+            continue;
+        if(len < 2 || _PEP3333_Bytes_AS_DATA(value)[len - 1] != '"') {
+            if(PyList_SetSlice(headers, i, i + 1, NULL) == -1)
+                return false;
+            --i;
+            continue;
+        }
+        PyObject* etag = bytes_printf("%.*s-%s\"", (int)len - 1, _PEP3333_Bytes_AS_DATA(value), encoding);
+        if(etag == NULL)
+            return false;
+        tuple = PyTuple_Pack(2, field, etag);
+        Py_DECREF(etag);
+        if(tuple == NULL)
+            return false;
+        if(PyList_SetItem(headers, i, tuple) == -1)
+            return false;
+    }
+    return true;
+}
+
+/* --precompressed: if there are precompressed versions of the file next to
+ * it (see static.c), send the one the client accepts instead, with
+ * sendfile() like the file itself. Only whole files are replaced, and
+ * without Range support. Returns 1 if the response was changed, 0 if the
+ * file is to be sent, -1 with an exception set on errors. */
+static int
+prepare_encoded_response(Request* request, PyObject* environ, struct stat* st)
+{
+    /* Files not opened by name have none, or an int one */
+    PyObject* name = PyObject_GetAttr(((FileWrapper*)request->iterable)->file, _name);
+    PyObject* path = name ? _PEP3333_FSPath(name) : NULL;
+    Py_XDECREF(name);
+    if(path == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+    PyObject* accept = PyDict_GetItem(environ, _HTTP_ACCEPT_ENCODING);
+    if(accept != NULL && (accept = _PEP3333_BytesLatin1_FromUnicode(accept)) == NULL) {
+        Py_DECREF(path);
+        return -1;
+    }
+
+    const char* encoding;
+    bool vary;
+    StaticFile* file;
+    Py_BEGIN_ALLOW_THREADS
+    file = Static_open_encoded(_PEP3333_Bytes_AS_DATA(path), _PEP3333_Bytes_GET_SIZE(path), &st->st_mtim,
+                               accept ? _PEP3333_Bytes_AS_DATA(accept) : NULL,
+                               accept ? _PEP3333_Bytes_GET_SIZE(accept) : 0,
+                               &encoding, &vary);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(path);
+    Py_XDECREF(accept);
+    request->state.vary_encoding = vary;
+    if(file == NULL)
+        return 0;
+
+    PyObject* headers = replace_response(request, NULL, false);
+    if(headers == NULL
+       || !encode_etag(headers, encoding)
+       || !append_header(headers, "Content-Encoding", bytes_printf("%s", encoding))
+       || !append_header(headers, "Content-Length", bytes_printf("%lld", (long long)file->size))) {
+        StaticFile_release(file);
+        return -1;
+    }
+    /* Sent instead of the app's file, see do_sendfile() */
+    request->static_file = file;
+    request->single_range.start = 0;
+    request->single_range.end = file->size;
+    request->ranges = &request->single_range;
+    request->range_count = 1;
+    request->file_offset = 0;
+    return 1;
+}
+
+/* Responses made of regular files are sent from the file's current position
+ * to its end. They get a Content-Length if the app didn't set one, so the
+ * connection can be kept alive, and 200 responses to GET requests support
+ * Range requests and precompressed versions of the file. Returns false with
+ * an exception set on errors. */
+static bool
+prepare_file_response(Request* request, PyObject* environ)
+{
+    struct stat st;
+    int fd = FileWrapper_GetFd(request->iterable);
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return true;
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if(start == -1)
+        start = 0;
+    else if(start > st.st_size)
+        start = st.st_size;
+    request->file_offset = start;
+    off_t size = st.st_size - start;
+
+    const char* status = _PEP3333_Bytes_AS_DATA(request->status);
+    if(request->parser.parser.method == HTTP_GET && !strncmp(status, "200", 3)
+       && find_header(request, "Content-Range") == NULL) {
+        if(request->server_info->precompressed && start == 0
+           && find_header(request, "Content-Encoding") == NULL) {
+            switch(prepare_encoded_response(request, environ, &st)) {
+            case -1:
+                return false;
+            case 1:
+                request->state.response_length_unknown = false;
+                return true;
+            }
+        }
+        if(find_header(request, "Accept-Ranges") == NULL)
+            /* Let clients know they can resume downloads */
+            request->state.accept_ranges = true;
+        switch(prepare_range_response(request, environ, start, size, &st)) {
+        case -1:
+            return false;
+        case 1:
+            request->state.response_length_unknown = false;
+            return true;
+        }
+    }
+
+    if(request->state.response_length_unknown
+       && strncmp(status, "204", 3) && strncmp(status, "304", 3)) {
+        PyObject* headers = replace_response(request, NULL, false);
+        if(headers == NULL
+           || !append_header(headers, "Content-Length", bytes_printf("%lld", (long long)size)))
+            return false;
+        request->state.response_length_unknown = false;
+    }
+    return true;
+}
+
 static void
 wsgi_getheaders(Request* request, PyObject** buf, Py_ssize_t* length)
 {
-    Py_ssize_t length_upperbound = strlen("HTTP/1.1 ") + _PEP3333_Bytes_GET_SIZE(request->status) + strlen("\r\nConnection: Keep-Alive") + strlen("\r\nTransfer-Encoding: chunked") + strlen("\r\n\r\n");
+    Py_ssize_t length_upperbound = strlen("HTTP/1.1 ") + _PEP3333_Bytes_GET_SIZE(request->status) + strlen("\r\nAccept-Ranges: bytes") + strlen("\r\nVary: Accept-Encoding") + strlen("\r\nConnection: Keep-Alive") + strlen("\r\nTransfer-Encoding: chunked") + strlen("\r\n\r\n");
     for(Py_ssize_t i = 0; i < PyList_GET_SIZE(request->headers); ++i) {
         PyObject* tuple = PyList_GET_ITEM(request->headers, i);
         PyObject* field = PyTuple_GET_ITEM(tuple, 0);
@@ -261,6 +702,12 @@ wsgi_getheaders(Request* request, PyObject** buf, Py_ssize_t* length)
         buf_write(_PEP3333_Bytes_AS_DATA(value), _PEP3333_Bytes_GET_SIZE(value));
     }
 
+    /* See `prepare_file_response` */
+    if(request->state.accept_ranges)
+        buf_write2("\r\nAccept-Ranges: bytes");
+    if(request->state.vary_encoding)
+        buf_write2("\r\nVary: Accept-Encoding");
+
     /* See `wsgi_call_application` */
     if(request->state.keep_alive) {
         buf_write2("\r\nConnection: Keep-Alive");
@@ -297,6 +744,69 @@ wsgi_iterable_get_next_chunk(Request* request)
     }
 }
 
+/* Take `first_chunk` (if not NULL) and as many items of the response iterator
+ * as fit into the write budget, so that iterators yielding lots of small items
+ * don't cost one write() (and one trip through the event loop) per item.
+ * Returns the number of chunks, or -1 with an exception set if the iterator
+ * raised. */
+static int
+collect_chunks(Request* request, PyObject* first_chunk, PyObject** chunks, int max_chunks)
+{
+    int n = 0;
+    size_t size = 0;
+
+    if(first_chunk) {
+        chunks[n++] = first_chunk;
+        size += _PEP3333_Bytes_GET_SIZE(first_chunk);
+    }
+
+    while(request->iterator && n < max_chunks
+          && size < (size_t)request->server_info->write_budget) {
+        PyObject* next_chunk = wsgi_iterable_get_next_chunk(request);
+        if(next_chunk == NULL) {
+            if(PyErr_Occurred()) {
+                while(n)
+                    Py_DECREF(chunks[--n]);
+                return -1;
+            }
+            /* This was the last chunk; cleanup. */
+            Py_CLEAR(request->iterator);
+            break;
+        }
+        chunks[n++] = next_chunk;
+        size += _PEP3333_Bytes_GET_SIZE(next_chunk);
+    }
+    return n;
+}
+
+/* Chunked responses get one HTTP chunk per call, and the terminating chunk
+ * once the iterator is exhausted. */
+static void
+queue_chunks(Request* request, PyObject** chunks, int n)
+{
+    if(n)
+        OutputQueue_push_chunks(request->output, chunks, n, request->state.chunked_response);
+
+    if(request->iterator == NULL && request->state.chunked_response) {
+        /* Send the terminating empty chunk along with the last data */
+        OutputQueue_push(request->output, "0\r\n\r\n", 5, NULL);
+        request->state.chunked_response = false;
+    }
+}
+
+/* Queue the next part of the response. Returns false with an exception set
+ * if the iterator raised. */
+bool
+wsgi_queue_chunks(Request* request)
+{
+    PyObject* chunks[OUTPUT_QUEUE_SIZE];
+    int n = collect_chunks(request, NULL, chunks, OutputQueue_space(request->output) - 3);
+    if(n == -1)
+        return false;
+    queue_chunks(request, chunks, n);
+    return true;
+}
+
 static inline void
 restore_exception_tuple(PyObject* exc_info, bool incref_items)
 {
@@ -384,24 +894,3 @@ PyTypeObject StartResponse_Type = {
     start_response              /* tp_call (__call__)                         */
 };
 
-
-PyObject*
-wrap_http_chunk_cruft_around(PyObject* chunk)
-{
-    /* Who the hell decided to use decimal representation for Content-Length
-     * but hexadecimal representation for chunk lengths btw!?! Fuck W3C */
-    size_t chunklen = _PEP3333_Bytes_GET_SIZE(chunk);
-    assert(chunklen);
-    char buf[strlen("ffffffff") + 2];
-    size_t n = sprintf(buf, "%x\r\n", (unsigned int)chunklen);
-    PyObject* new_chunk = _PEP3333_Bytes_FromStringAndSize(NULL, n + chunklen + 2);
-    char* new_chunk_p = (char*)_PEP3333_Bytes_AS_DATA(new_chunk);
-    memcpy(new_chunk_p, buf, n);
-    new_chunk_p += n;
-    memcpy(new_chunk_p, _PEP3333_Bytes_AS_DATA(chunk), chunklen);
-    new_chunk_p += chunklen;
-    *new_chunk_p++ = '\r';
-    *new_chunk_p = '\n';
-    assert(new_chunk_p == _PEP3333_Bytes_AS_DATA(new_chunk) + n + chunklen + 1);
-    return new_chunk;
-}
@@ -3,6 +3,6 @@
 
 bool wsgi_call_application(Request*);
 PyObject* wsgi_iterable_get_next_chunk(Request*);
-PyObject* wrap_http_chunk_cruft_around(PyObject* chunk);
+bool wsgi_queue_chunks(Request*);
 
 PyTypeObject StartResponse_Type;
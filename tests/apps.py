@@ -0,0 +1,51 @@
+"""WSGI applications for the regression tests"""
+import hashlib
+import os
+
+
+def echo(environ, start_response):
+    """/echo: the body's length and MD5. /gen: the same from a response
+    iterator, after sending a first item (and with ?late, 200 KB more).
+    Anything else: "hello"."""
+    path = environ['PATH_INFO']
+    inp = environ['wsgi.input']
+    if path == '/echo':
+        out = digest(inp.read())
+        start_response('200 OK', [('Content-Length', str(len(out)))])
+        return [out]
+    if path == '/gen':
+        start_response('200 OK', [])
+
+        def gen():
+            yield b'start;'
+            if environ.get('QUERY_STRING') == 'late':
+                yield b'.' * 200000
+            yield digest(inp.read())
+        return gen()
+    start_response('200 OK', [('Content-Length', '5')])
+    return [b'hello']
+
+
+def digest(data):
+    return ('%d %s' % (len(data), hashlib.md5(data).hexdigest())).encode()
+
+
+def files(environ, start_response):
+    """$TEST_FILES/PATH through wsgi.file_wrapper, with fixed validators"""
+    path = os.path.join(os.environ['TEST_FILES'], environ['PATH_INFO'].lstrip('/'))
+    headers = [('Content-Type', 'application/octet-stream'),
+               ('ETag', '"v1"'),
+               ('Last-Modified', 'Sat, 17 Oct 2026 10:00:00 GMT'),
+               ('Content-Length', str(os.path.getsize(path)))]
+    start_response('200 OK', headers)
+    if environ['REQUEST_METHOD'] == 'HEAD':
+        return []
+    return environ['wsgi.file_wrapper'](open(path, 'rb'))
+
+
+def assets(environ, start_response):
+    """$TEST_FILES/www/NAME for .../NAME through wsgi.file_wrapper, for -z"""
+    name = environ['PATH_INFO'].rsplit('/', 1)[-1]
+    path = os.path.join(os.environ['TEST_FILES'], 'www', name)
+    start_response('200 OK', [('Content-Type', 'text/javascript'), ('ETag', '"v1"')])
+    return environ['wsgi.file_wrapper'](open(path, 'rb'))
@@ -0,0 +1,160 @@
+"""Regression test helpers: start bjoern on a free port, talk raw HTTP/1.1
+
+BJOERN selects the binary to test (default: ../build/bjoern) and
+BJOERN_ARGS adds options to every server, e.g. --io-uring. Every test class
+starts its own server with `server_args`, which end with the app, e.g.
+['-e', '-a', '2', 'apps:echo']; apps are looked up in tests/apps.py.
+"""
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import tempfile
+import time
+import unittest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+BJOERN = os.path.abspath(os.environ.get('BJOERN', os.path.join(HERE, '..', 'build', 'bjoern')))
+BJOERN_ARGS = os.environ.get('BJOERN_ARGS', '').split()
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+class Response(object):
+    def __init__(self, status, headers, body):
+        self.status = status    # e.g. 200
+        self.headers = headers  # lowercase name -> value
+        self.body = body
+
+    def __repr__(self):
+        return 'Response(%d, %r, %d bytes)' % (self.status, self.headers, len(self.body))
+
+
+def read_response(f, head=False):
+    """Read one response from the socket file `f`. A response to a HEAD
+    request (`head`) has no body. Returns None on EOF."""
+    line = f.readline()
+    if not line:
+        return None
+    status = int(line.split()[1])
+    headers = {}
+    while True:
+        line = f.readline()
+        if line in (b'\r\n', b''):
+            break
+        name, _, value = line.decode('latin-1').partition(':')
+        headers[name.strip().lower()] = value.strip()
+    if head or status in (100, 204, 304):
+        body = b''
+    elif 'content-length' in headers:
+        body = f.read(int(headers['content-length']))
+    elif headers.get('transfer-encoding') == 'chunked':
+        body = b''
+        while True:
+            size = int(f.readline().split(b';')[0], 16)
+            if size == 0:
+                f.readline()
+                break
+            body += f.read(size)
+            f.readline()
+    else:
+        body = f.read()
+    return Response(status, headers, body)
+
+
+class ServerTestCase(unittest.TestCase):
+    server_args = []
+
+    @classmethod
+    def setUpClass(cls):
+        cls.port = free_port()
+        cls.log = tempfile.TemporaryFile()
+        cls.server = subprocess.Popen(
+            [BJOERN, '-p', str(cls.port)] + BJOERN_ARGS + cls.server_args,
+            cwd=HERE, stdout=cls.log, stderr=subprocess.STDOUT)
+        for _ in range(100):
+            try:
+                socket.create_connection(('127.0.0.1', cls.port)).close()
+                return
+            except socket.error:
+                if cls.server.poll() is not None:
+                    break
+                time.sleep(0.05)
+        cls.tearDownClass()
+        raise RuntimeError('bjoern did not start')
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.server.send_signal(signal.SIGINT)
+        try:
+            cls.server.wait(5)
+        except subprocess.TimeoutExpired:
+            cls.server.kill()
+            cls.server.wait()
+        cls.log.seek(0)
+        log = cls.log.read().decode('utf-8', 'replace')
+        cls.log.close()
+        if 'ERROR: AddressSanitizer' in log or 'Assertion' in log:
+            raise AssertionError('bjoern failed:\n' + log)
+
+    def connect(self, timeout=5):
+        s = socket.create_connection(('127.0.0.1', self.port))
+        s.settimeout(timeout)
+        self.addCleanup(s.close)
+        return s
+
+    def request(self, path, headers=(), method='GET', body=b''):
+        """Send one request on a new connection and return its response"""
+        s = self.connect()
+        lines = ['%s %s HTTP/1.1' % (method, path), 'Host: test']
+        lines += ['%s: %s' % h for h in headers]
+        if body:
+            lines.append('Content-Length: %d' % len(body))
+        s.sendall(('\r\n'.join(lines) + '\r\n\r\n').encode('latin-1') + body)
+        return read_response(s.makefile('rb'), head=method == 'HEAD')
+
+    def assertStatus(self, response, status):
+        self.assertIsNotNone(response, 'connection closed')
+        self.assertEqual(response.status, status, response)
+
+
+class FilesTestCase(ServerTestCase):
+    """A ServerTestCase with a directory of test files, available to apps
+    as $TEST_FILES and in `server_args`. `files` maps paths in it to
+    contents; the mtime of those in `stale` is set back by an hour."""
+    files = {}
+    stale = ()
+
+    @classmethod
+    def setUpClass(cls):
+        cls.root = tempfile.mkdtemp()
+        for name, data in cls.files.items():
+            path = os.path.join(cls.root, name)
+            if not os.path.isdir(os.path.dirname(path)):
+                os.makedirs(os.path.dirname(path))
+            with open(path, 'wb') as f:
+                f.write(data)
+        for name in cls.stale:
+            t = time.time() - 3600
+            os.utime(os.path.join(cls.root, name), (t, t))
+        os.environ['TEST_FILES'] = cls.root
+        cls.server_args = [arg.replace('$TEST_FILES', cls.root) for arg in cls.server_args]
+        try:
+            super(FilesTestCase, cls).setUpClass()
+        except Exception:
+            shutil.rmtree(cls.root)
+            raise
+
+    @classmethod
+    def tearDownClass(cls):
+        try:
+            super(FilesTestCase, cls).tearDownClass()
+        finally:
+            shutil.rmtree(cls.root)
@@ -0,0 +1,99 @@
+"""Early dispatch (-e): the app is called once the headers are parsed and
+wsgi.input reads the body as it arrives"""
+import time
+import unittest
+
+from apps import digest
+from harness import ServerTestCase, read_response
+
+
+class EarlyDispatchTest(ServerTestCase):
+    server_args = ['-e', '-a', '2', 'apps:echo']
+
+    def test_stalled_upload_does_not_block_others(self):
+        s = self.connect()
+        s.sendall(b'POST /echo HTTP/1.1\r\nHost: test\r\nContent-Length: 10\r\n\r\nabc')
+        time.sleep(0.2)
+        started = time.time()
+        self.assertEqual(self.request('/hi').body, b'hello')
+        self.assertLess(time.time() - started, 1)
+        s.sendall(b'defghij')
+        self.assertEqual(read_response(s.makefile('rb')).body, digest(b'abcdefghij'))
+
+    def test_continue_is_sent_when_the_app_reads(self):
+        s = self.connect()
+        f = s.makefile('rb')
+        s.sendall(b'POST /echo HTTP/1.1\r\nHost: test\r\nContent-Length: 4\r\n'
+                  b'Expect: 100-continue\r\n\r\n')
+        self.assertStatus(read_response(f), 100)
+        s.sendall(b'body')
+        response = read_response(f)
+        self.assertStatus(response, 200)
+        self.assertEqual(response.body, digest(b'body'))
+
+    def test_chunked_upload(self):
+        s = self.connect()
+        s.sendall(b'POST /echo HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n\r\n'
+                  b'3\r\nabc\r\n')
+        time.sleep(0.2)
+        s.sendall(b'4\r\ndefg\r\n0\r\n\r\n')
+        self.assertEqual(read_response(s.makefile('rb')).body, digest(b'abcdefg'))
+
+    def test_response_iterator_waits_for_the_body(self):
+        s = self.connect()
+        s.sendall(b'POST /gen HTTP/1.1\r\nHost: test\r\nContent-Length: 3\r\n\r\n')
+        time.sleep(0.3)
+        s.sendall(b'xyz')
+        self.assertEqual(read_response(s.makefile('rb')).body, b'start;' + digest(b'xyz'))
+
+    def test_response_iterator_reads_a_late_body(self):
+        # The iterator is still running when the app call returns; the body
+        # is buffered for it, and other clients are served meanwhile
+        s = self.connect()
+        s.sendall(b'POST /gen?late HTTP/1.1\r\nHost: test\r\nContent-Length: 3\r\n\r\n')
+        time.sleep(0.2)
+        self.assertEqual(self.request('/hi').body, b'hello')
+        s.sendall(b'xyz')
+        response = read_response(s.makefile('rb'))
+        self.assertTrue(response.body.startswith(b'start;'))
+        self.assertTrue(response.body.endswith(digest(b'xyz')), response.body[-40:])
+
+    def test_continue_follows_pipelined_responses(self):
+        for n in range(3):
+            s = self.connect()
+            f = s.makefile('rb')
+            s.sendall(b'GET /hi HTTP/1.1\r\nHost: test\r\n\r\n' * n +
+                      b'POST /echo HTTP/1.1\r\nHost: test\r\nContent-Length: 4\r\n'
+                      b'Expect: 100-continue\r\n\r\n')
+            for i in range(n):
+                self.assertEqual(read_response(f).body, b'hello')
+            self.assertStatus(read_response(f), 100)
+            s.sendall(b'body')
+            self.assertEqual(read_response(f).body, digest(b'body'))
+
+    def test_pipelined_response_before_body(self):
+        # The client waits for the GET's response before sending the body
+        s = self.connect(timeout=2)
+        f = s.makefile('rb')
+        s.sendall(b'GET /hi HTTP/1.1\r\nHost: test\r\n\r\n'
+                  b'POST /echo HTTP/1.1\r\nHost: test\r\nContent-Length: 4\r\n\r\n')
+        self.assertEqual(read_response(f).body, b'hello')
+        s.sendall(b'body')
+        self.assertEqual(read_response(f).body, digest(b'body'))
+
+
+class BufferedBodyTest(ServerTestCase):
+    # Without app threads, -e has no effect and the body is read first
+    server_args = ['-e', 'apps:echo']
+
+    def test_body(self):
+        self.assertEqual(self.request('/echo', method='POST', body=b'body').body,
+                         digest(b'body'))
+
+    def test_response_iterator(self):
+        self.assertEqual(self.request('/gen', method='POST', body=b'xyz').body,
+                         b'start;' + digest(b'xyz'))
+
+
+if __name__ == '__main__':
+    unittest.main()
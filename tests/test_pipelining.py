@@ -0,0 +1,53 @@
+"""Pipelined requests are answered in order, also with early dispatch"""
+import time
+import unittest
+
+from apps import digest
+from harness import ServerTestCase, read_response
+
+GET = b'GET /hi HTTP/1.1\r\nHost: test\r\n\r\n'
+POST = b'POST /echo HTTP/1.1\r\nHost: test\r\nContent-Length: 4\r\n\r\nbody'
+
+
+class PipeliningTest(ServerTestCase):
+    server_args = ['apps:echo']
+
+    def check_responses(self, f, expected):
+        for body in expected:
+            response = read_response(f)
+            self.assertStatus(response, 200)
+            self.assertEqual(response.body, body)
+
+    def test_in_order(self):
+        s = self.connect()
+        s.sendall((GET + POST) * 3 + GET)
+        self.check_responses(s.makefile('rb'),
+                             [b'hello', digest(b'body')] * 3 + [b'hello'])
+
+    def test_split_across_reads(self):
+        s = self.connect()
+        data = (GET + POST) * 2
+        for i in range(0, len(data), 7):
+            s.sendall(data[i:i + 7])
+            time.sleep(0.001)
+        self.check_responses(s.makefile('rb'), [b'hello', digest(b'body')] * 2)
+
+    def test_many(self):
+        s = self.connect()
+        s.sendall(GET * 200)
+        self.check_responses(s.makefile('rb'), [b'hello'] * 200)
+
+    def test_connection_close(self):
+        s = self.connect()
+        s.sendall(GET + b'GET /hi HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n' + GET)
+        f = s.makefile('rb')
+        self.check_responses(f, [b'hello', b'hello'])
+        self.assertIsNone(read_response(f))
+
+
+class EarlyDispatchPipeliningTest(PipeliningTest):
+    server_args = ['-e', '-a', '2', 'apps:echo']
+
+
+if __name__ == '__main__':
+    unittest.main()
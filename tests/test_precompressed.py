@@ -0,0 +1,114 @@
+"""Precompressed siblings (FILE.br, .zst, .gz) for static routes and, with
+-z, for wsgi.file_wrapper responses"""
+import gzip
+import unittest
+
+from harness import FilesTestCase
+
+JS = b'function hello() { return "hello"; }\n' * 20
+BR = b'not really brotli'
+ZST = b'not really zstd'
+GZ = gzip.compress(JS)
+
+
+class NegotiationTests(object):
+    """Run for the static route (/static/) and for the app (/app/)"""
+    files = {
+        'www/app.js': JS, 'www/app.js.br': BR, 'www/app.js.zst': ZST, 'www/app.js.gz': GZ,
+        'www/plain.js': JS,
+        'www/only.js': JS, 'www/only.js.gz': GZ,
+        'www/stale.js': JS, 'www/stale.js.br': BR, 'www/stale.js.gz': GZ,
+    }
+    stale = ('www/stale.js.br',)
+    base = None
+
+    def get(self, name, accept=None, *headers):
+        headers = list(headers)
+        if accept is not None:
+            headers.append(('Accept-Encoding', accept))
+        return self.request(self.base + name, headers)
+
+    def assertEncoded(self, response, data, encoding):
+        self.assertStatus(response, 200)
+        self.assertEqual(response.body, data)
+        self.assertEqual(response.headers.get('content-encoding'), encoding, response)
+        self.assertEqual(response.headers.get('vary'), 'Accept-Encoding', response)
+        self.assertTrue(response.headers['content-type'].startswith('text/javascript'), response)
+        self.assertEqual(response.headers['content-length'], str(len(data)))
+
+    def test_preference(self):
+        self.assertEncoded(self.get('app.js', 'gzip, deflate, br, zstd'), BR, 'br')
+        self.assertEncoded(self.get('app.js', 'gzip, zstd'), ZST, 'zstd')
+        self.assertEncoded(self.get('app.js', 'gzip'), GZ, 'gzip')
+
+    def test_qvalues(self):
+        self.assertEncoded(self.get('app.js', 'x-gzip;q=0.5, br;q=0'), GZ, 'gzip')
+        self.assertEncoded(self.get('app.js', '*;q=1, br;q=0.000, zstd;q=0'), GZ, 'gzip')
+        self.assertEncoded(self.get('app.js', 'gzip;q=0, identity'), JS, None)
+
+    def test_no_accept_encoding(self):
+        self.assertEncoded(self.get('app.js'), JS, None)
+
+    def test_no_siblings(self):
+        response = self.get('plain.js', 'gzip, br')
+        self.assertStatus(response, 200)
+        self.assertEqual(response.body, JS)
+        self.assertNotIn('content-encoding', response.headers)
+        self.assertNotIn('vary', response.headers)
+
+    def test_only_some_siblings(self):
+        self.assertEncoded(self.get('only.js', 'br, gzip'), GZ, 'gzip')
+        self.assertEncoded(self.get('only.js', 'br'), JS, None)
+
+    def test_stale_sibling_is_skipped(self):
+        # stale.js.br is older than stale.js, so it isn't sent
+        self.assertEncoded(self.get('stale.js', 'br, gzip'), GZ, 'gzip')
+        self.assertEncoded(self.get('stale.js', 'br'), JS, None)
+
+
+class StaticPrecompressedTest(NegotiationTests, FilesTestCase):
+    server_args = ['-s', '/static=$TEST_FILES/www', 'apps:assets']
+    base = '/static/'
+
+    def test_validators_per_encoding(self):
+        br = self.get('app.js', 'br')
+        gz = self.get('app.js', 'gzip')
+        self.assertNotEqual(br.headers['etag'], gz.headers['etag'])
+        response = self.get('app.js', 'br', ('If-None-Match', br.headers['etag']))
+        self.assertStatus(response, 304)
+        self.assertEqual(response.headers.get('vary'), 'Accept-Encoding')
+        self.assertEncoded(self.get('app.js', 'gzip', ('If-None-Match', br.headers['etag'])),
+                           GZ, 'gzip')
+
+    def test_range_of_encoded_file(self):
+        response = self.get('app.js', 'br', ('Range', 'bytes=2-5'))
+        self.assertStatus(response, 206)
+        self.assertEqual(response.body, BR[2:6])
+        self.assertEqual(response.headers['content-encoding'], 'br')
+
+    def test_siblings_themselves(self):
+        response = self.get('app.js.gz', 'gzip')
+        self.assertEqual(response.body, GZ)
+        self.assertNotIn('content-encoding', response.headers)
+
+
+class AppPrecompressedTest(NegotiationTests, FilesTestCase):
+    server_args = ['-z', 'apps:assets']
+    base = '/app/'
+
+    def test_etag_per_encoding(self):
+        self.assertEqual(self.get('app.js', 'br').headers['etag'], '"v1-br"')
+        self.assertEqual(self.get('app.js').headers['etag'], '"v1"')
+
+    def test_ranges(self):
+        # Only for the identity encoding
+        response = self.get('app.js', 'br', ('Range', 'bytes=0-3'))
+        self.assertEncoded(response, BR, 'br')
+        response = self.get('app.js', None, ('Range', 'bytes=0-3'))
+        self.assertStatus(response, 206)
+        self.assertEqual(response.body, JS[:4])
+        self.assertEqual(response.headers['vary'], 'Accept-Encoding')
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,123 @@
+"""Range and If-Range for wsgi.file_wrapper responses"""
+import os
+import re
+import unittest
+
+from harness import FilesTestCase, read_response
+
+SMALL = bytes(bytearray(range(256))) * 4  # 1024 bytes
+BIG = os.urandom(3000000)
+LAST_MODIFIED = 'Sat, 17 Oct 2026 10:00:00 GMT'
+
+
+class RangeTest(FilesTestCase):
+    server_args = ['apps:files']
+    files = {'small': SMALL, 'big': BIG, 'empty': b''}
+
+    def get_range(self, path, spec, *headers):
+        return self.request(path, [('Range', spec)] + list(headers))
+
+    def assertPartial(self, response, data, content_range):
+        self.assertStatus(response, 206)
+        self.assertEqual(response.headers['content-range'], content_range)
+        self.assertEqual(response.headers['content-length'], str(len(data)))
+        self.assertEqual(response.body, data)
+
+    def assertWhole(self, response, data):
+        self.assertStatus(response, 200)
+        self.assertNotIn('content-range', response.headers)
+        self.assertEqual(response.body, data)
+
+    def parts(self, response):
+        """(headers, data) of each part of a multipart/byteranges body"""
+        self.assertStatus(response, 206)
+        m = re.match(r'multipart/byteranges; boundary=(\w+)$', response.headers['content-type'])
+        self.assertTrue(m, response.headers)
+        delimiter = b'\r\n--' + m.group(1).encode()
+        parts = response.body.split(delimiter)
+        self.assertEqual(parts[0], b'')
+        self.assertEqual(parts[-1], b'--\r\n')
+        result = []
+        for part in parts[1:-1]:
+            head, _, data = part.partition(b'\r\n\r\n')
+            result.append((head.decode().split('\r\n')[1:], data))
+        return result
+
+    def test_whole_file_advertises_ranges(self):
+        response = self.request('/small')
+        self.assertWhole(response, SMALL)
+        self.assertEqual(response.headers['accept-ranges'], 'bytes')
+
+    def test_single_range(self):
+        self.assertPartial(self.get_range('/small', 'bytes=10-19'), SMALL[10:20], 'bytes 10-19/1024')
+
+    def test_suffix_range(self):
+        self.assertPartial(self.get_range('/small', 'bytes=-5'), SMALL[-5:], 'bytes 1019-1023/1024')
+        self.assertPartial(self.get_range('/small', 'bytes=-5000'), SMALL, 'bytes 0-1023/1024')
+
+    def test_open_range(self):
+        self.assertPartial(self.get_range('/small', 'bytes=1000-'), SMALL[1000:], 'bytes 1000-1023/1024')
+
+    def test_range_is_clipped_to_the_file(self):
+        self.assertPartial(self.get_range('/small', 'bytes=1000-5000'), SMALL[1000:], 'bytes 1000-1023/1024')
+
+    def test_unsatisfiable(self):
+        for spec in ('bytes=1024-', 'bytes=2000-3000', 'bytes=-0', 'bytes=1024-,2000-'):
+            response = self.get_range('/small', spec)
+            self.assertStatus(response, 416)
+            self.assertEqual(response.headers['content-range'], 'bytes */1024')
+            self.assertEqual(response.body, b'')
+        self.assertStatus(self.get_range('/empty', 'bytes=0-'), 416)
+
+    def test_unsatisfiable_ranges_are_dropped(self):
+        self.assertPartial(self.get_range('/small', 'bytes=2000-,0-1'), SMALL[:2], 'bytes 0-1/1024')
+
+    def test_invalid_ranges_are_ignored(self):
+        for spec in ('bytes=5-1', 'items=0-1', 'bytes=', 'bytes=a-b', 'bytes=1-2;3-4',
+                     'bytes=' + ','.join(['0-0'] * 17)):
+            self.assertWhole(self.get_range('/small', spec), SMALL)
+
+    def test_if_range(self):
+        self.assertPartial(self.get_range('/small', 'bytes=0-1', ('If-Range', '"v1"')),
+                           SMALL[:2], 'bytes 0-1/1024')
+        self.assertPartial(self.get_range('/small', 'bytes=0-1', ('If-Range', LAST_MODIFIED)),
+                           SMALL[:2], 'bytes 0-1/1024')
+        self.assertWhole(self.get_range('/small', 'bytes=0-1', ('If-Range', '"v2"')), SMALL)
+        self.assertWhole(self.get_range('/small', 'bytes=0-1', ('If-Range', 'W/"v1"')), SMALL)
+        self.assertWhole(self.get_range('/small', 'bytes=0-1',
+                                        ('If-Range', 'Sun, 18 Oct 2026 10:00:00 GMT')), SMALL)
+
+    def test_multipart(self):
+        response = self.get_range('/small', 'bytes=0-9, 20-29,-3')
+        self.assertEqual(response.headers['content-length'], str(len(response.body)))
+        self.assertEqual(self.parts(response), [
+            (['Content-Type: application/octet-stream', 'Content-Range: bytes 0-9/1024'], SMALL[0:10]),
+            (['Content-Type: application/octet-stream', 'Content-Range: bytes 20-29/1024'], SMALL[20:30]),
+            (['Content-Type: application/octet-stream', 'Content-Range: bytes 1021-1023/1024'], SMALL[-3:]),
+        ])
+
+    def test_large_ranges(self):
+        self.assertPartial(self.get_range('/big', 'bytes=100000-2999999'),
+                           BIG[100000:], 'bytes 100000-2999999/3000000')
+        parts = self.parts(self.get_range('/big', 'bytes=0-1999999,2500000-'))
+        self.assertEqual([data for _, data in parts], [BIG[:2000000], BIG[2500000:]])
+
+    def test_keep_alive_and_pipelining(self):
+        s = self.connect()
+        f = s.makefile('rb')
+        s.sendall(b'GET /small HTTP/1.1\r\nHost: test\r\nRange: bytes=0-3\r\n\r\n'
+                  b'GET /small HTTP/1.1\r\nHost: test\r\nRange: bytes=4-7,9-9\r\n\r\n'
+                  b'HEAD /small HTTP/1.1\r\nHost: test\r\nRange: bytes=4-7\r\n\r\n')
+        self.assertPartial(read_response(f), SMALL[:4], 'bytes 0-3/1024')
+        self.assertEqual([data for _, data in self.parts(read_response(f))],
+                         [SMALL[4:8], SMALL[9:10]])
+        # Ranges are only defined for GET
+        response = read_response(f, head=True)
+        self.assertStatus(response, 200)
+        self.assertEqual(response.headers['content-length'], '1024')
+        s.sendall(b'GET /small HTTP/1.1\r\nHost: test\r\n\r\n')
+        self.assertWhole(read_response(f), SMALL)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,124 @@
+"""Static routes (-s PREFIX=DIR), answered without the app"""
+import os
+import re
+import time
+import unittest
+
+from harness import FilesTestCase, read_response
+
+BIG = os.urandom(300000)
+
+
+class StaticTest(FilesTestCase):
+    server_args = ['-s', '/static=$TEST_FILES/www', 'apps:echo']
+    files = {
+        'www/index.html': b'<h1>hi</h1>\n',
+        'www/big.bin': BIG,
+        'www/sub/style.css': b'body{}\n',
+        'www/a..b.txt': b'dots\n',
+        'secret.txt': b'secret\n',
+    }
+
+    def assertFile(self, response, data):
+        self.assertStatus(response, 200)
+        self.assertEqual(response.body, data)
+
+    def test_file(self):
+        response = self.request('/static/sub/style.css')
+        self.assertFile(response, b'body{}\n')
+        self.assertTrue(response.headers['content-type'].startswith('text/css'), response)
+        self.assertEqual(response.headers['accept-ranges'], 'bytes')
+        self.assertTrue(re.match(r'^"[^"]+"$', response.headers['etag']), response)
+        self.assertTrue(response.headers['last-modified'].endswith(' GMT'), response)
+        self.assertFile(self.request('/static/big.bin'), BIG)
+        self.assertFile(self.request('/static/sub/style.css?v=1'), b'body{}\n')
+        self.assertFile(self.request('/static/a..b.txt'), b'dots\n')
+
+    def test_index(self):
+        self.assertFile(self.request('/static'), b'<h1>hi</h1>\n')
+        self.assertFile(self.request('/static/'), b'<h1>hi</h1>\n')
+
+    def test_head(self):
+        response = self.request('/static/big.bin', method='HEAD')
+        self.assertStatus(response, 200)
+        self.assertEqual(response.headers['content-length'], str(len(BIG)))
+
+    def test_not_found(self):
+        for path in ('/static/missing', '/static/sub', '/static/sub/', '/static/a%00b'):
+            self.assertStatus(self.request(path), 404)
+
+    def test_dotdot_is_rejected(self):
+        for path in ('/static/../secret.txt', '/static/sub/../../secret.txt',
+                     '/static/%2e%2e/secret.txt', '/static/%2E%2E/secret.txt',
+                     '/static/..%2fsecret.txt', '/static/sub/..%2F..%2Fsecret.txt',
+                     '/static/sub/..', '/static/..'):
+            response = self.request(path)
+            self.assertStatus(response, 404)
+            self.assertNotIn(b'secret', response.body)
+
+    def test_bad_escape(self):
+        self.assertStatus(self.request('/static/%zz'), 400)
+
+    def test_other_requests_go_to_the_app(self):
+        self.assertEqual(self.request('/staticx/a').body, b'hello')
+        self.assertEqual(self.request('/static/sub/style.css', method='POST', body=b'x').body,
+                         b'hello')
+
+    def test_conditional(self):
+        response = self.request('/static/big.bin')
+        etag = response.headers['etag']
+        last_modified = response.headers['last-modified']
+        for value in (etag, 'W/' + etag, '"other", ' + etag, '*'):
+            self.assertStatus(self.request('/static/big.bin', [('If-None-Match', value)]), 304)
+        self.assertStatus(self.request('/static/big.bin', [('If-Modified-Since', last_modified)]), 304)
+        # If-None-Match takes precedence
+        self.assertFile(self.request('/static/big.bin', [('If-None-Match', '"other"'),
+                                                         ('If-Modified-Since', last_modified)]), BIG)
+
+    def test_ranges(self):
+        response = self.request('/static/big.bin', [('Range', 'bytes=10-19')])
+        self.assertStatus(response, 206)
+        self.assertEqual(response.headers['content-range'], 'bytes 10-19/%d' % len(BIG))
+        self.assertEqual(response.body, BIG[10:20])
+        self.assertEqual(self.request('/static/big.bin', [('Range', 'bytes=-5')]).body, BIG[-5:])
+        response = self.request('/static/big.bin', [('Range', 'bytes=%d-' % len(BIG))])
+        self.assertStatus(response, 416)
+        self.assertEqual(response.headers['content-range'], 'bytes */%d' % len(BIG))
+        etag = self.request('/static/big.bin').headers['etag']
+        self.assertStatus(self.request('/static/big.bin', [('Range', 'bytes=0-1'), ('If-Range', etag)]), 206)
+        self.assertFile(self.request('/static/big.bin', [('Range', 'bytes=0-1'), ('If-Range', '"old"')]), BIG)
+
+    def test_pipelining(self):
+        s = self.connect()
+        f = s.makefile('rb')
+        s.sendall(b'GET /static/sub/style.css HTTP/1.1\r\nHost: test\r\n\r\n'
+                  b'GET /app HTTP/1.1\r\nHost: test\r\n\r\n'
+                  b'HEAD /static/index.html HTTP/1.1\r\nHost: test\r\n\r\n'
+                  b'GET /static/missing HTTP/1.1\r\nHost: test\r\n\r\n'
+                  b'POST /static/index.html HTTP/1.1\r\nHost: test\r\nContent-Length: 3\r\n\r\nabc'
+                  b'GET /static/index.html HTTP/1.1\r\nHost: test\r\n\r\n')
+        self.assertFile(read_response(f), b'body{}\n')
+        self.assertFile(read_response(f), b'hello')
+        self.assertStatus(read_response(f, head=True), 200)
+        self.assertStatus(read_response(f), 404)
+        self.assertFile(read_response(f), b'hello')
+        self.assertFile(read_response(f), b'<h1>hi</h1>\n')
+
+    def test_changed_file(self):
+        path = os.path.join(self.root, 'www', 'changing.txt')
+        with open(path, 'wb') as f:
+            f.write(b'one')
+        self.assertFile(self.request('/static/changing.txt'), b'one')
+        # Cached stat results are revalidated after a second
+        time.sleep(1.1)
+        with open(path + '.tmp', 'wb') as f:
+            f.write(b'second')
+        os.rename(path + '.tmp', path)
+        self.assertFile(self.request('/static/changing.txt'), b'second')
+        os.unlink(path)
+        time.sleep(1.1)
+        self.assertStatus(self.request('/static/changing.txt'), 404)
+
+
+if __name__ == '__main__':
+    unittest.main()